@@ -20,4 +20,30 @@
 #define daylightOffset_sec 0
 
 #define minIrrMinutes 0 
-#define maxIrrMinutes 480 
\ No newline at end of file
+#define maxIrrMinutes 480 
+
+// Soil moisture sensor (must be an ADC1 pin)
+#define SOIL_SENSOR_PIN 34
+#define SOIL_SAMPLE_RATE_HZ 20000   // lowest rate the ESP32 ADC DMA supports
+#define SOIL_DECIMATION 2000        // 20 kHz / 2000 = 10 filtered readings/s
+#define SOIL_DRY_RAW 3000           // probe reading in dry air
+#define SOIL_WET_RAW 1300           // probe reading in water
+#define defaultFieldCapacity 35     // percent volumetric moisture
+
+// Command trace capture (enabled in the config portal)
+#define TRACE_FILE "/trace.log"
+#define TRACE_OLD_FILE "/trace.old"
+#define TRACE_MAX_BYTES (64 * 1024)
+
+// Fixed buffer sizes: nothing is heap-allocated after setup()
+#define ID_BUFFER_SIZE 32
+#define SSID_BUFFER_SIZE 33       // 802.11 SSID max 32 chars
+#define SECRET_BUFFER_SIZE 65     // WPA2 passphrase max 64 chars
+#define HOST_BUFFER_SIZE 64
+#define TOPIC_BUFFER_SIZE 96
+#include "json_sizes.h"           // JSON_ARENA_SIZE, STATUS_BUFFER_SIZE
+#define MQTT_BUFFER_SIZE (STATUS_BUFFER_SIZE + TOPIC_BUFFER_SIZE + 8)
+
+// MQTT over TLS (enabled in the config portal)
+#define MQTT_KEEPALIVE_SEC 60     // TLS only
+#define MQTT_PLAIN_KEEPALIVE_SEC 15
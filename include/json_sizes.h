@@ -0,0 +1,9 @@
+#ifndef JSON_SIZES_H
+#define JSON_SIZES_H
+
+// JSON buffers, kept apart from config.h (which needs Arduino.h) so the
+// native tests check the same sizes the firmware is built with
+#define JSON_ARENA_SIZE 1536      // per JsonDocument (command, status)
+#define STATUS_BUFFER_SIZE 640
+
+#endif
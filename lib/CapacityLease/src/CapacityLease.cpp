@@ -0,0 +1,220 @@
+#include "CapacityLease.h"
+#include <stdio.h>
+#include <string.h>
+
+CapacityLease::CapacityLease()
+    : entryCount(0), budget(0), units(0), maxWaitMs(0), settleMs(0), holdTtlMs(0), renewMs(0),
+      overflowed(false), roomSinceTs(0), status(LEASE_NONE), requestTs(0), echoTs(0), lastPublishTs(0) {
+    selfId[0] = '\0';
+}
+
+bool CapacityLease::begin(const char* deviceId, uint16_t budget, uint16_t units, uint32_t maxWaitMs,
+                          uint32_t settleMs, uint32_t holdTtlMs) {
+    if (strlen(deviceId) >= sizeof(selfId)) {
+        return false;
+    }
+    strcpy(selfId, deviceId);
+    this->budget = budget;
+    this->units = units;
+    this->maxWaitMs = maxWaitMs;
+    this->settleMs = settleMs;
+    this->holdTtlMs = holdTtlMs;
+    entryCount = 0;
+    overflowed = false;
+    roomSinceTs = 0;
+    release();
+    return true;
+}
+
+CapacityLease::Entry* CapacityLease::find(const char* id) {
+    for (uint8_t i = 0; i < entryCount; i++) {
+        if (strcmp(entries[i].id, id) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+bool CapacityLease::isLive(const Entry& entry, uint64_t nowMs) const {
+    return entry.expiryTs > nowMs;
+}
+
+// True if `entry` is queued before our own request
+bool CapacityLease::ahead(const Entry& entry) const {
+    if (entry.requestTs != requestTs) {
+        return entry.requestTs < requestTs;
+    }
+    return strcmp(entry.id, selfId) < 0;
+}
+
+bool CapacityLease::hasRoom(uint64_t nowMs) const {
+    if (entryCount < LEASE_MAX_DEVICES) return true;
+    for (uint8_t i = 0; i < entryCount; i++) {
+        if (!isLive(entries[i], nowMs)) return true;
+    }
+    return false;
+}
+
+// After a dropped update the table may be missing a holder, so stay closed
+// until there has been room for a whole hold TTL
+void CapacityLease::trackOverflow(uint64_t nowMs) {
+    if (!overflowed) return;
+    if (!hasRoom(nowMs)) {
+        roomSinceTs = 0;
+    } else if (roomSinceTs == 0) {
+        roomSinceTs = nowMs;
+    } else if (nowMs - roomSinceTs >= holdTtlMs) {
+        overflowed = false;
+        roomSinceTs = 0;
+    }
+}
+
+void CapacityLease::onMessage(const char* deviceId, const char* payload, size_t length, uint64_t nowMs) {
+    // Controllers with longer IDs refuse to lease, so they never publish here
+    if (strlen(deviceId) >= LEASE_ID_LEN) {
+        return;
+    }
+    Entry* entry = find(deviceId);
+
+    if (length == 0) {
+        if (entry) {
+            *entry = entries[--entryCount];
+        }
+        trackOverflow(nowMs);
+        return;
+    }
+
+    char text[64];
+    if (length >= sizeof(text)) return;
+    memcpy(text, payload, length);
+    text[length] = '\0';
+
+    char type;
+    unsigned entryUnits;
+    unsigned long long ts, expiry;
+    if (sscanf(text, "%c %u %llu %llu", &type, &entryUnits, &ts, &expiry) != 4 ||
+        (type != 'W' && type != 'H')) {
+        return;
+    }
+
+    if (!entry) {
+        if (entryCount == LEASE_MAX_DEVICES) {
+            // Reuse an expired slot before dropping the update
+            for (uint8_t i = 0; i < entryCount && !entry; i++) {
+                if (!isLive(entries[i], nowMs)) entry = &entries[i];
+            }
+            if (!entry) {
+                overflowed = true;
+                roomSinceTs = 0;
+                return;
+            }
+        } else {
+            entry = &entries[entryCount++];
+        }
+        strcpy(entry->id, deviceId);
+    }
+    entry->status = type;
+    entry->units = entryUnits;
+    entry->requestTs = ts;
+    entry->expiryTs = expiry;
+
+    if (status == LEASE_WAITING && echoTs == 0 && type == 'W' && ts == requestTs &&
+        strcmp(deviceId, selfId) == 0) {
+        echoTs = nowMs;
+    }
+    trackOverflow(nowMs);
+}
+
+size_t CapacityLease::request(uint64_t nowMs, char* payload, size_t size) {
+    status = LEASE_WAITING;
+    requestTs = nowMs;
+    echoTs = 0;
+
+    int n = snprintf(payload, size, "W %u %llu %llu", units, (unsigned long long)requestTs,
+                     (unsigned long long)(nowMs + maxWaitMs + settleMs));
+    return (n > 0 && (size_t)n < size) ? n : 0;
+}
+
+CapacityLease::Decision CapacityLease::poll(uint64_t nowMs, char* payload, size_t size, size_t* length) {
+    *length = 0;
+    if (status != LEASE_WAITING) {
+        return DECISION_NONE;
+    }
+
+    if (nowMs - requestTs > maxWaitMs) {
+        release();
+        return DECISION_TIMED_OUT;
+    }
+
+    // Until our own request has come back and settled, messages published
+    // before it may still be in flight to us
+    if (echoTs == 0 || nowMs - echoTs < settleMs) {
+        return DECISION_WAITING;
+    }
+
+    // Fail closed: a dropped holder would otherwise go uncounted
+    trackOverflow(nowMs);
+    if (overflowed) {
+        return DECISION_WAITING;
+    }
+
+    uint32_t claimed = units;
+    for (uint8_t i = 0; i < entryCount; i++) {
+        const Entry& entry = entries[i];
+        if (strcmp(entry.id, selfId) == 0 || !isLive(entry, nowMs)) continue;
+        if (entry.status == 'H' || ahead(entry)) {
+            claimed += entry.units;
+        }
+    }
+    if (claimed > budget) {
+        return DECISION_WAITING;
+    }
+
+    status = LEASE_HELD;
+    lastPublishTs = nowMs;
+    int n = snprintf(payload, size, "H %u %llu %llu", units, (unsigned long long)requestTs,
+                     (unsigned long long)(nowMs + holdTtlMs));
+    *length = (n > 0 && (size_t)n < size) ? n : 0;
+    return DECISION_GRANTED;
+}
+
+size_t CapacityLease::renew(uint64_t nowMs, char* payload, size_t size) {
+    uint32_t interval = holdTtlMs / 3;
+    if (renewMs > 0 && renewMs < interval) {
+        interval = renewMs;
+    }
+    if (status != LEASE_HELD || nowMs - lastPublishTs < interval) {
+        return 0;
+    }
+    lastPublishTs = nowMs;
+    int n = snprintf(payload, size, "H %u %llu %llu", units, (unsigned long long)requestTs,
+                     (unsigned long long)(nowMs + holdTtlMs));
+    return (n > 0 && (size_t)n < size) ? n : 0;
+}
+
+void CapacityLease::release() {
+    status = LEASE_NONE;
+    requestTs = 0;
+    echoTs = 0;
+}
+
+uint16_t CapacityLease::unitsInUse(uint64_t nowMs) const {
+    uint32_t total = status == LEASE_HELD ? units : 0;
+    for (uint8_t i = 0; i < entryCount; i++) {
+        const Entry& entry = entries[i];
+        if (strcmp(entry.id, selfId) == 0 || !isLive(entry, nowMs)) continue;
+        if (entry.status == 'H') {
+            total += entry.units;
+        }
+    }
+    return total;
+}
+
+const char* CapacityLease::statusName(Status status) {
+    switch (status) {
+        case LEASE_NONE: return "none";
+        case LEASE_WAITING: return "waiting";
+        case LEASE_HELD: return "held";
+    }
+    return "unknown";
+}
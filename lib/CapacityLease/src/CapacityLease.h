@@ -0,0 +1,130 @@
+#ifndef CAPACITYLEASE_H
+#define CAPACITYLEASE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LEASE_MAX_DEVICES 32
+
+// Device IDs must be shorter than this; they are never truncated, since two
+// IDs sharing a prefix would otherwise merge into one lease entry
+#ifndef LEASE_ID_LEN
+#define LEASE_ID_LEN 32
+#endif
+
+// Fleet-wide supply capacity leasing. Every controller publishes its lease
+// as a retained message on <prefix>/<deviceId>:
+//
+//   W <units> <request_ts> <expiry_ts>    waiting for capacity
+//   H <units> <request_ts> <expiry_ts>    holding capacity (pump may run)
+//   (empty)                               released
+//
+// Timestamps are epoch milliseconds (NTP). The last-will on the same topic
+// is an empty retained message, so a controller that drops off the broker
+// gives its capacity back. Hold entries are renewed periodically and
+// ignored once expired, in case a stale retained message survives a broker
+// restart.
+//
+// Each controller decides for itself from the shared table. Waiters are
+// served FIFO by (request_ts, deviceId): a waiter may take its lease once
+// its own request has come back from the broker, a settle period has
+// passed, and
+//
+//   held units + units of all waiters ahead of it + own units <= budget
+//
+// Counting earlier waiters as if they already held keeps later requests
+// from overtaking them. If an update ever has to be dropped because the
+// table is full, nothing is granted until the table has had room for a full
+// hold TTL, by which time every live holder has renewed into it. This class
+// is transport-free; the firmware and tools/lease_sim.cpp do the MQTT side.
+class CapacityLease {
+public:
+    enum Status {
+        LEASE_NONE,
+        LEASE_WAITING,
+        LEASE_HELD
+    };
+
+    enum Decision {
+        DECISION_NONE,
+        DECISION_WAITING,
+        DECISION_GRANTED,
+        DECISION_TIMED_OUT
+    };
+
+private:
+    struct Entry {
+        char id[LEASE_ID_LEN];
+        char status;
+        uint16_t units;
+        uint64_t requestTs;
+        uint64_t expiryTs;
+    };
+
+    Entry entries[LEASE_MAX_DEVICES];
+    uint8_t entryCount;
+
+    char selfId[LEASE_ID_LEN];
+    uint16_t budget;
+    uint16_t units;
+    uint32_t maxWaitMs;
+    uint32_t settleMs;
+    uint32_t holdTtlMs;
+    uint32_t renewMs;
+
+    bool overflowed;
+    uint64_t roomSinceTs;
+
+    Status status;
+    uint64_t requestTs;
+    uint64_t echoTs;
+    uint64_t lastPublishTs;
+
+    Entry* find(const char* id);
+    bool isLive(const Entry& entry, uint64_t nowMs) const;
+    bool ahead(const Entry& entry) const;
+    bool hasRoom(uint64_t nowMs) const;
+    void trackOverflow(uint64_t nowMs);
+
+public:
+    CapacityLease();
+
+    // Returns false if the device ID does not fit in LEASE_ID_LEN.
+    bool begin(const char* deviceId, uint16_t budget, uint16_t units, uint32_t maxWaitMs,
+               uint32_t settleMs = 2000, uint32_t holdTtlMs = 180000);
+
+    // Renew holds more often than every ttl / 3, e.g. so the caller can
+    // watch its own renewals come back as a broker liveness check.
+    void setRenewInterval(uint32_t ms) { renewMs = ms; }
+
+    // Feed every message received on <prefix>/+, including our own echo.
+    void onMessage(const char* deviceId, const char* payload, size_t length, uint64_t nowMs);
+
+    // Starts waiting. Fills `payload` with the retained message to publish.
+    size_t request(uint64_t nowMs, char* payload, size_t size);
+
+    // Evaluates a pending request. On DECISION_GRANTED `payload` holds the
+    // hold message to publish; on DECISION_TIMED_OUT the caller publishes an
+    // empty retained message.
+    Decision poll(uint64_t nowMs, char* payload, size_t size, size_t* length);
+
+    // While holding, returns a refreshed hold message once per ttl / 3
+    // (or the renew interval, if shorter).
+    size_t renew(uint64_t nowMs, char* payload, size_t size);
+
+    // Gives the lease up; the caller publishes an empty retained message.
+    void release();
+
+    Status getStatus() const { return status; }
+    uint64_t getRequestTs() const { return requestTs; }
+    uint16_t getBudget() const { return budget; }
+    uint16_t getUnits() const { return units; }
+    bool isOverflowed() const { return overflowed; }
+
+    // Units currently held across the fleet, own lease included.
+    uint16_t unitsInUse(uint64_t nowMs) const;
+
+    static const char* statusName(Status status);
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef ARENAALLOCATOR_H
+#define ARENAALLOCATOR_H
+
+#include <ArduinoJson.h>
+#include <stdint.h>
+#include <string.h>
+
+// ArduinoJson allocator backed by a fixed, statically allocated buffer, so a
+// JsonDocument never touches the heap after startup.
+//
+// Bump allocation: blocks are carved from the front of the buffer and the
+// whole arena is reclaimed once every block has been freed, which happens on
+// each doc.clear() / deserializeJson(). Growing the most recent block (what
+// ArduinoJson does while reading strings) happens in place. When the arena
+// is full, allocate() returns NULL and the document reports overflowed().
+template <size_t N>
+class ArenaAllocator : public ArduinoJson::Allocator {
+private:
+    static const size_t ALIGN = 8;
+    static const size_t HEADER = ALIGN;  // block size, padded to keep alignment
+
+    alignas(ALIGN) uint8_t buffer[N];
+    size_t used;
+    size_t lastOffset;
+    size_t liveBlocks;
+    size_t peak;
+    size_t failures;
+
+    static size_t align(size_t size) { return (size + ALIGN - 1) & ~(ALIGN - 1); }
+
+    size_t blockSize(void* ptr) const {
+        size_t size;
+        memcpy(&size, (uint8_t*)ptr - HEADER, sizeof(size));
+        return size;
+    }
+
+    bool isLast(void* ptr) const {
+        return (uint8_t*)ptr == buffer + lastOffset + HEADER && liveBlocks > 0;
+    }
+
+public:
+    ArenaAllocator() : used(0), lastOffset(0), liveBlocks(0), peak(0), failures(0) {}
+
+    void* allocate(size_t size) override {
+        size_t total = HEADER + align(size);
+        if (total > N - used) {
+            failures++;
+            return NULL;
+        }
+        lastOffset = used;
+        memcpy(buffer + used, &size, sizeof(size));
+        used += total;
+        liveBlocks++;
+        if (used > peak) peak = used;
+        return buffer + lastOffset + HEADER;
+    }
+
+    void deallocate(void* ptr) override {
+        if (ptr == NULL) return;
+        if (isLast(ptr)) {
+            used = lastOffset;
+        }
+        if (--liveBlocks == 0) {
+            used = 0;
+            lastOffset = 0;
+        }
+    }
+
+    void* reallocate(void* ptr, size_t newSize) override {
+        if (ptr == NULL) {
+            return allocate(newSize);
+        }
+
+        if (isLast(ptr)) {
+            size_t total = HEADER + align(newSize);
+            if (total > N - lastOffset) {
+                failures++;
+                return NULL;
+            }
+            memcpy(buffer + lastOffset, &newSize, sizeof(newSize));
+            used = lastOffset + total;
+            if (used > peak) peak = used;
+            return ptr;
+        }
+
+        // An older block can only shrink in place; its tail stays unused
+        // until the arena resets
+        size_t oldSize = blockSize(ptr);
+        if (newSize <= oldSize) {
+            return ptr;
+        }
+        void* moved = allocate(newSize);
+        if (moved == NULL) {
+            return NULL;
+        }
+        memcpy(moved, ptr, oldSize);
+        deallocate(ptr);
+        return moved;
+    }
+
+    size_t capacity() const { return N; }
+    size_t peakUsage() const { return peak; }
+    size_t failureCount() const { return failures; }
+};
+
+#endif
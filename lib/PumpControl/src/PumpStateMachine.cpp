@@ -0,0 +1,196 @@
+#include "PumpStateMachine.h"
+#include <string.h>
+
+PumpStateMachine::PumpStateMachine(uint16_t minMinutes, uint16_t maxMinutes)
+    : minMinutes(minMinutes), maxMinutes(maxMinutes),
+      traceCallback(NULL), traceContext(NULL) {
+    reset(0);
+}
+
+void PumpStateMachine::setTraceCallback(TraceCallback callback, void* context) {
+    traceCallback = callback;
+    traceContext = context;
+}
+
+void PumpStateMachine::reset(uint32_t nowMs) {
+    state = IDLE;
+    irrigationStartTime = 0;
+    irrigationDuration = 0;
+    remainingTime = 0;
+    pumpActive = false;
+    stopReason = "";
+    lastUpdateMs = nowMs;
+    lastWindow = -1;
+    lastFieldCapacity = -1;
+
+    TraceEvent event = {};
+    event.type = 'B';
+    event.timeMs = nowMs;
+    event.minMinutes = minMinutes;
+    event.maxMinutes = maxMinutes;
+    emit(event);
+}
+
+void PumpStateMachine::emit(const TraceEvent& event) {
+    if (traceCallback) {
+        traceCallback(event, traceContext);
+    }
+}
+
+void PumpStateMachine::observeInputs(uint32_t nowMs, bool irrigationAllowed, bool fieldCapacityReached) {
+    TraceEvent event = {};
+    event.timeMs = nowMs;
+
+    if (lastWindow != (irrigationAllowed ? 1 : 0)) {
+        lastWindow = irrigationAllowed ? 1 : 0;
+        event.type = 'W';
+        event.flag = irrigationAllowed;
+        emit(event);
+    }
+    if (lastFieldCapacity != (fieldCapacityReached ? 1 : 0)) {
+        lastFieldCapacity = fieldCapacityReached ? 1 : 0;
+        event.type = 'F';
+        event.flag = fieldCapacityReached;
+        emit(event);
+    }
+}
+
+// Only a running cycle depends on tick timing, so idle stalls are not recorded
+void PumpStateMachine::checkLateTick(uint32_t nowMs) {
+    if (state == IRRIGATING && nowMs - lastUpdateMs > TRACE_LATE_TICK_MS) {
+        TraceEvent event = {};
+        event.type = 'K';
+        event.timeMs = nowMs;
+        event.gapMs = nowMs - lastUpdateMs;
+        emit(event);
+        lastUpdateMs = nowMs;
+    }
+}
+
+void PumpStateMachine::transition(uint32_t nowMs, PumpState to, const char* reason) {
+    TraceEvent event = {};
+    event.type = 'T';
+    event.timeMs = nowMs;
+    event.from = state;
+    event.to = to;
+    event.remainingMs = remainingTime;
+    strncpy(event.reason, reason, sizeof(event.reason) - 1);
+
+    state = to;
+    pumpActive = (to == IRRIGATING);
+    stopReason = reason;
+    emit(event);
+}
+
+CommandResult PumpStateMachine::handleCommand(PumpSignal signal, float irrTimeMinutes, uint32_t nowMs,
+                                              bool irrigationAllowed) {
+    // A command handled right after a stall (e.g. the first client.loop()
+    // after a reconnect) must record the stall before it changes the state
+    checkLateTick(nowMs);
+    observeInputs(nowMs, irrigationAllowed, lastFieldCapacity == 1);
+
+    TraceEvent event = {};
+    event.type = 'C';
+    event.timeMs = nowMs;
+    event.signal = signal;
+    event.irrTime = irrTimeMinutes;
+    emit(event);
+
+    // Validate irrigation time
+    if (signal == SIGNAL_ON && irrTimeMinutes <= minMinutes) {
+        return CMD_TIME_TOO_SHORT;
+    }
+    if (signal == SIGNAL_ON && irrTimeMinutes > maxMinutes) {
+        return CMD_TIME_TOO_LONG;
+    }
+
+    if (signal == SIGNAL_ON && state == IDLE && irrigationAllowed) {
+        irrigationDuration = (uint32_t)(irrTimeMinutes * 60 * 1000);
+        remainingTime = irrigationDuration;
+        irrigationStartTime = nowMs;
+        transition(nowMs, IRRIGATING, "");
+    }
+    else if (signal == SIGNAL_ON && state == EMERGENCY_HALT && irrigationAllowed) {
+        irrigationDuration = remainingTime;
+        irrigationStartTime = nowMs;
+        transition(nowMs, IRRIGATING, "");
+    }
+    else if (signal == SIGNAL_EMERGENCY_HALT && state == IRRIGATING) {
+        // After a stall the cycle may already be overdue; never wrap around
+        uint32_t elapsed = nowMs - irrigationStartTime;
+        remainingTime = elapsed < irrigationDuration ? irrigationDuration - elapsed : 0;
+        transition(nowMs, EMERGENCY_HALT, "emergency_halt");
+    }
+    else if (signal == SIGNAL_STOP) {
+        irrigationDuration = 0;
+        remainingTime = 0;
+        transition(nowMs, IDLE, "stop_command");
+    }
+    else {
+        return CMD_IGNORED;
+    }
+    return CMD_ACCEPTED;
+}
+
+bool PumpStateMachine::wouldStart(PumpSignal signal, float irrTimeMinutes, bool irrigationAllowed) const {
+    return signal == SIGNAL_ON && irrigationAllowed &&
+           irrTimeMinutes > minMinutes && irrTimeMinutes <= maxMinutes &&
+           (state == IDLE || state == EMERGENCY_HALT);
+}
+
+bool PumpStateMachine::update(uint32_t nowMs, bool irrigationAllowed, bool fieldCapacityReached) {
+    checkLateTick(nowMs);
+    lastUpdateMs = nowMs;
+    observeInputs(nowMs, irrigationAllowed, fieldCapacityReached);
+
+    switch (state) {
+        case IDLE:
+            break;
+
+        case IRRIGATING:
+            if (!irrigationAllowed) {
+                transition(nowMs, EMERGENCY_HALT, "outside_window");
+                return true;
+            }
+            if (fieldCapacityReached) {
+                irrigationDuration = 0;
+                remainingTime = 0;
+                transition(nowMs, IDLE, "field_capacity");
+                return true;
+            }
+            if (nowMs - irrigationStartTime >= irrigationDuration) {
+                irrigationDuration = 0;
+                remainingTime = 0;
+                transition(nowMs, IDLE, "completed");
+                return true;
+            }
+            remainingTime = irrigationDuration - (nowMs - irrigationStartTime);
+            break;
+
+        case EMERGENCY_HALT:
+            break;
+
+        case FAULT:
+            pumpActive = false;
+            break;
+    }
+    return false;
+}
+
+const char* PumpStateMachine::stateName(PumpState state) {
+    switch (state) {
+        case IDLE: return "IDLE";
+        case IRRIGATING: return "IRRIGATING";
+        case EMERGENCY_HALT: return "EMERGENCY_HALT";
+        case FAULT: return "FAULT";
+    }
+    return "UNKNOWN";
+}
+
+PumpSignal PumpStateMachine::parseSignal(const char* signal) {
+    if (signal == NULL) return SIGNAL_UNKNOWN;
+    if (strcmp(signal, "On") == 0) return SIGNAL_ON;
+    if (strcmp(signal, "Emergency Halt") == 0) return SIGNAL_EMERGENCY_HALT;
+    if (strcmp(signal, "Stop") == 0) return SIGNAL_STOP;
+    return SIGNAL_UNKNOWN;
+}
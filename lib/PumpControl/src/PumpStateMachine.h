@@ -0,0 +1,85 @@
+#ifndef PUMPSTATEMACHINE_H
+#define PUMPSTATEMACHINE_H
+
+#include <stdint.h>
+#include "PumpTrace.h"
+
+// System states
+enum PumpState {
+    IDLE,
+    IRRIGATING,
+    EMERGENCY_HALT,
+    FAULT
+};
+
+enum PumpSignal {
+    SIGNAL_UNKNOWN,
+    SIGNAL_ON,
+    SIGNAL_EMERGENCY_HALT,
+    SIGNAL_STOP
+};
+
+enum CommandResult {
+    CMD_ACCEPTED,
+    CMD_TIME_TOO_SHORT,
+    CMD_TIME_TOO_LONG,
+    CMD_IGNORED
+};
+
+// Irrigation state machine. Hardware-free: the caller supplies the clock
+// (millis) and the irrigation-window / field-capacity inputs and drives the
+// relay from isPumpActive(). The firmware and tools/trace_replay.cpp run this
+// same code.
+class PumpStateMachine {
+public:
+    typedef void (*TraceCallback)(const TraceEvent& event, void* context);
+
+private:
+    uint16_t minMinutes;
+    uint16_t maxMinutes;
+
+    PumpState state;
+    uint32_t irrigationStartTime;
+    uint32_t irrigationDuration;
+    uint32_t remainingTime;
+    bool pumpActive;
+    const char* stopReason;
+    uint32_t lastUpdateMs;
+
+    int8_t lastWindow;
+    int8_t lastFieldCapacity;
+    TraceCallback traceCallback;
+    void* traceContext;
+
+    void observeInputs(uint32_t nowMs, bool irrigationAllowed, bool fieldCapacityReached);
+    void checkLateTick(uint32_t nowMs);
+    void transition(uint32_t nowMs, PumpState to, const char* reason);
+    void emit(const TraceEvent& event);
+
+public:
+    PumpStateMachine(uint16_t minMinutes, uint16_t maxMinutes);
+
+    void setTraceCallback(TraceCallback callback, void* context);
+    void reset(uint32_t nowMs);
+
+    // Applies a command. Returns CMD_IGNORED when the signal is not valid
+    // in the current state or outside the irrigation window.
+    CommandResult handleCommand(PumpSignal signal, float irrTimeMinutes, uint32_t nowMs,
+                                bool irrigationAllowed);
+
+    // True if handleCommand() with these arguments would start the pump.
+    bool wouldStart(PumpSignal signal, float irrTimeMinutes, bool irrigationAllowed) const;
+
+    // Periodic tick. Returns true if the state changed.
+    bool update(uint32_t nowMs, bool irrigationAllowed, bool fieldCapacityReached);
+
+    PumpState getState() const { return state; }
+    bool isPumpActive() const { return pumpActive; }
+    uint32_t getRemainingTime() const { return remainingTime; }
+    const char* getStopReason() const { return stopReason; }
+
+    static const char* stateName(PumpState state);
+    static PumpSignal parseSignal(const char* signal);
+};
+
+#endif
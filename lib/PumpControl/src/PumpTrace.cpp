@@ -0,0 +1,81 @@
+#include "PumpTrace.h"
+#include <stdio.h>
+#include <string.h>
+
+size_t formatTraceEvent(const TraceEvent& event, char* buffer, size_t size) {
+    int n = -1;
+    switch (event.type) {
+        case 'B':
+            n = snprintf(buffer, size, "B %lu %u %u\n", (unsigned long)event.timeMs,
+                         event.minMinutes, event.maxMinutes);
+            break;
+        case 'C':
+            n = snprintf(buffer, size, "C %lu %u %.3f\n", (unsigned long)event.timeMs,
+                         event.signal, event.irrTime);
+            break;
+        case 'W':
+        case 'F':
+            n = snprintf(buffer, size, "%c %lu %d\n", event.type, (unsigned long)event.timeMs,
+                         event.flag ? 1 : 0);
+            break;
+        case 'K':
+            n = snprintf(buffer, size, "K %lu %lu\n", (unsigned long)event.timeMs,
+                         (unsigned long)event.gapMs);
+            break;
+        case 'T':
+            n = snprintf(buffer, size, "T %lu %u %u %lu %s\n", (unsigned long)event.timeMs,
+                         event.from, event.to, (unsigned long)event.remainingMs,
+                         event.reason[0] ? event.reason : "-");
+            break;
+    }
+    if (n < 0 || (size_t)n >= size) {
+        return 0;
+    }
+    return (size_t)n;
+}
+
+bool parseTraceEvent(const char* line, TraceEvent& event) {
+    memset(&event, 0, sizeof(event));
+    unsigned long timeMs = 0;
+    unsigned a = 0, b = 0;
+    unsigned long remaining = 0;
+    int flag = 0;
+
+    switch (line[0]) {
+        case 'B':
+            if (sscanf(line, "B %lu %u %u", &timeMs, &a, &b) != 3) return false;
+            event.minMinutes = a;
+            event.maxMinutes = b;
+            break;
+        case 'C':
+            if (sscanf(line, "C %lu %u %f", &timeMs, &a, &event.irrTime) != 3) return false;
+            event.signal = a;
+            break;
+        case 'W':
+        case 'F':
+            if (sscanf(line + 1, " %lu %d", &timeMs, &flag) != 2) return false;
+            event.flag = flag != 0;
+            break;
+        case 'K':
+            if (sscanf(line, "K %lu %lu", &timeMs, &remaining) != 2) return false;
+            event.gapMs = remaining;
+            break;
+        case 'T':
+            if (sscanf(line, "T %lu %u %u %lu %15s", &timeMs, &a, &b, &remaining, event.reason) != 5) {
+                return false;
+            }
+            event.from = a;
+            event.to = b;
+            event.remainingMs = remaining;
+            if (strcmp(event.reason, "-") == 0) {
+                event.reason[0] = '\0';
+            }
+            break;
+        default:
+            return false;
+    }
+
+    event.type = line[0];
+    event.timeMs = timeMs;
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef PUMPTRACE_H
+#define PUMPTRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A tick or command that arrives more than this long after the previous tick
+// while irrigating is recorded as a K line, so the replay can reproduce the stall
+// (e.g. loop() blocked on a WiFi/MQTT reconnect) instead of assuming 1 s ticks.
+#define TRACE_LATE_TICK_MS 1500
+
+// One line of a command trace. Traces are plain text, one event per line:
+//
+//   B <ms> <minIrrMinutes> <maxIrrMinutes>   boot / state machine reset
+//   C <ms> <signal> <irr_time>               command addressed to this device
+//   W <ms> <0|1>                             irrigation window opened/closed
+//   F <ms> <0|1>                             field capacity flag changed
+//   T <ms> <from> <to> <remaining_ms> <reason>   state transition
+//   K <ms> <gap_ms>                          late tick, gap_ms after the last one
+//
+// B, C, W, F and K are inputs; T lines are the recorded outputs that
+// tools/trace_replay.cpp checks the state machine against.
+struct TraceEvent {
+    char type;
+    uint32_t timeMs;
+    uint8_t signal;
+    float irrTime;
+    bool flag;
+    uint16_t minMinutes;
+    uint16_t maxMinutes;
+    uint8_t from;
+    uint8_t to;
+    uint32_t remainingMs;
+    uint32_t gapMs;
+    char reason[16];
+};
+
+// Writes `event` as a single newline-terminated line. Returns the length
+// written, or 0 if it did not fit.
+size_t formatTraceEvent(const TraceEvent& event, char* buffer, size_t size);
+
+// Parses one trace line. Returns false for blank, comment or malformed lines.
+bool parseTraceEvent(const char* line, TraceEvent& event);
+
+#endif
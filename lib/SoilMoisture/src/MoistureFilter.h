@@ -0,0 +1,130 @@
+#ifndef MOISTUREFILTER_H
+#define MOISTUREFILTER_H
+
+#include <stdint.h>
+
+// Integer-only filter for raw 12-bit ADC samples. No Arduino dependencies so
+// it can be driven from recorded sensor traces on the host (tools/).
+//
+// Raw samples are box-averaged in blocks of `decimation`, then a running
+// median over the last MEDIAN_WINDOW decimated values rejects spikes from
+// pump/relay switching noise.
+class MoistureFilter {
+public:
+    static const uint8_t MEDIAN_WINDOW = 5;
+
+private:
+    uint16_t decimation;
+    uint32_t accumulator;
+    uint16_t accumulated;
+
+    uint16_t window[MEDIAN_WINDOW];
+    uint8_t windowPos;
+    uint8_t windowFill;
+
+    uint16_t median;
+    uint16_t dryRaw;
+    uint16_t wetRaw;
+
+    uint16_t computeMedian() const {
+        uint16_t sorted[MEDIAN_WINDOW];
+        for (uint8_t i = 0; i < windowFill; i++) {
+            uint16_t v = window[i];
+            uint8_t j = i;
+            while (j > 0 && sorted[j - 1] > v) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = v;
+        }
+        return sorted[windowFill / 2];
+    }
+
+public:
+    explicit MoistureFilter(uint16_t decimation = 64)
+        : decimation(decimation ? decimation : 1), dryRaw(4095), wetRaw(0) {
+        reset();
+    }
+
+    void reset() {
+        accumulator = 0;
+        accumulated = 0;
+        windowPos = 0;
+        windowFill = 0;
+        median = 0;
+    }
+
+    // Raw ADC readings for a sensor in dry air and in saturated soil.
+    // Capacitive probes read lower when wet, resistive probes higher;
+    // either ordering works.
+    void setCalibration(uint16_t dry, uint16_t wet) {
+        dryRaw = dry;
+        wetRaw = wet;
+    }
+
+    // Feed one raw sample. Returns true when a new decimated value entered
+    // the median window.
+    bool push(uint16_t raw) {
+        accumulator += raw & 0x0FFF;
+        if (++accumulated < decimation) {
+            return false;
+        }
+
+        window[windowPos] = (uint16_t)(accumulator / accumulated);
+        windowPos = (windowPos + 1) % MEDIAN_WINDOW;
+        if (windowFill < MEDIAN_WINDOW) {
+            windowFill++;
+        }
+        accumulator = 0;
+        accumulated = 0;
+
+        median = computeMedian();
+        return true;
+    }
+
+    bool ready() const { return windowFill == MEDIAN_WINDOW; }
+    uint16_t rawMedian() const { return median; }
+
+    // Volumetric moisture estimate in tenths of a percent (0..1000).
+    uint16_t moisturePermille() const {
+        int32_t span = (int32_t)wetRaw - (int32_t)dryRaw;
+        if (span == 0) {
+            return 0;
+        }
+        int32_t permille = ((int32_t)median - (int32_t)dryRaw) * 1000 / span;
+        if (permille < 0) return 0;
+        if (permille > 1000) return 1000;
+        return (uint16_t)permille;
+    }
+};
+
+// Closed-loop stop decision: field capacity counts as reached only after
+// `holdCount` consecutive readings at or above the threshold, so a single
+// wet splash on the probe does not end a cycle.
+class FieldCapacityDetector {
+private:
+    uint16_t thresholdPermille;
+    uint8_t holdCount;
+    uint8_t consecutive;
+
+public:
+    explicit FieldCapacityDetector(uint16_t thresholdPermille = 1000, uint8_t holdCount = 3)
+        : thresholdPermille(thresholdPermille), holdCount(holdCount ? holdCount : 1), consecutive(0) {}
+
+    void setThreshold(uint16_t permille) { thresholdPermille = permille; }
+    uint16_t getThreshold() const { return thresholdPermille; }
+    void reset() { consecutive = 0; }
+
+    bool update(uint16_t moisturePermille) {
+        if (moisturePermille >= thresholdPermille) {
+            if (consecutive < holdCount) {
+                consecutive++;
+            }
+        } else {
+            consecutive = 0;
+        }
+        return consecutive >= holdCount;
+    }
+};
+
+#endif
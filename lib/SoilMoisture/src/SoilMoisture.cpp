@@ -0,0 +1,110 @@
+#include "SoilMoisture.h"
+#include <driver/adc.h>
+
+#define ADC_FRAME_BYTES 256
+#define ADC_STORE_BYTES 1024
+
+SoilMoisture::SoilMoisture(uint8_t pin, uint32_t sampleRateHz, uint16_t decimation)
+    : pin(pin), sampleRateHz(sampleRateHz), filter(decimation), task(NULL),
+      mux(portMUX_INITIALIZER_UNLOCKED), running(false),
+      latestPermille(0), latestRaw(0), valid(false) {
+}
+
+bool SoilMoisture::begin(uint16_t dryRaw, uint16_t wetRaw) {
+    if (running) return true;
+
+    int8_t channel = digitalPinToAnalogChannel(pin);
+    if (channel < 0 || channel >= SOC_ADC_CHANNEL_NUM(0)) {
+        // ADC2 is shared with WiFi and cannot be used by the DMA controller
+        Serial.println("Soil sensor pin is not an ADC1 channel");
+        return false;
+    }
+
+    filter.setCalibration(dryRaw, wetRaw);
+    filter.reset();
+
+    adc_digi_init_config_t initConfig = {};
+    initConfig.max_store_buf_size = ADC_STORE_BYTES;
+    initConfig.conv_num_each_intr = ADC_FRAME_BYTES;
+    initConfig.adc1_chan_mask = BIT(channel);
+    initConfig.adc2_chan_mask = 0;
+    if (adc_digi_initialize(&initConfig) != ESP_OK) {
+        Serial.println("ADC DMA init failed");
+        return false;
+    }
+
+    adc_digi_pattern_config_t pattern = {};
+    pattern.atten = ADC_ATTEN_DB_11;
+    pattern.channel = channel;
+    pattern.unit = 0;
+    pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+
+    adc_digi_configuration_t digiConfig = {};
+    digiConfig.conv_limit_en = true;
+    digiConfig.conv_limit_num = 250;
+    digiConfig.pattern_num = 1;
+    digiConfig.adc_pattern = &pattern;
+    digiConfig.sample_freq_hz = sampleRateHz;
+    digiConfig.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+    digiConfig.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+    if (adc_digi_controller_configure(&digiConfig) != ESP_OK) {
+        Serial.println("ADC DMA configure failed");
+        adc_digi_deinitialize();
+        return false;
+    }
+
+    running = true;
+    adc_digi_start();
+    xTaskCreatePinnedToCore(taskEntry, "soil_adc", 3072, this, 1, &task, 0);
+
+    Serial.print("Soil sensor sampling at ");
+    Serial.print(sampleRateHz);
+    Serial.println(" Hz (DMA)");
+    return true;
+}
+
+void SoilMoisture::end() {
+    if (!running) return;
+
+    running = false;
+    // The task notices `running` after its next (bounded) read and deletes itself
+    while (task != NULL) {
+        delay(10);
+    }
+    adc_digi_stop();
+    adc_digi_deinitialize();
+    valid = false;
+}
+
+void SoilMoisture::taskEntry(void* arg) {
+    static_cast<SoilMoisture*>(arg)->readLoop();
+}
+
+void SoilMoisture::readLoop() {
+    uint8_t buffer[ADC_FRAME_BYTES];
+
+    while (running) {
+        uint32_t length = 0;
+        esp_err_t err = adc_digi_read_bytes(buffer, sizeof(buffer), &length, 100);
+        if (err != ESP_OK) {
+            continue;
+        }
+
+        bool updated = false;
+        for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+            adc_digi_output_data_t* out = (adc_digi_output_data_t*)&buffer[i];
+            updated |= filter.push(out->type1.data);
+        }
+
+        if (updated && filter.ready()) {
+            portENTER_CRITICAL(&mux);
+            latestRaw = filter.rawMedian();
+            latestPermille = filter.moisturePermille();
+            valid = true;
+            portEXIT_CRITICAL(&mux);
+        }
+    }
+
+    task = NULL;
+    vTaskDelete(NULL);
+}
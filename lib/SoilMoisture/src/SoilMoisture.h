@@ -0,0 +1,37 @@
+#ifndef SOILMOISTURE_H
+#define SOILMOISTURE_H
+
+#include <Arduino.h>
+#include "MoistureFilter.h"
+
+// Soil-moisture probe sampled through the ESP32 ADC digital controller.
+// Conversions are written to memory by DMA; a background task wakes once per
+// DMA frame and feeds the samples through MoistureFilter, so the main loop
+// never polls the ADC.
+class SoilMoisture {
+private:
+    uint8_t pin;
+    uint32_t sampleRateHz;
+    MoistureFilter filter;
+    TaskHandle_t task;
+    portMUX_TYPE mux;
+    bool running;
+
+    volatile uint16_t latestPermille;
+    volatile uint16_t latestRaw;
+    volatile bool valid;
+
+    static void taskEntry(void* arg);
+    void readLoop();
+
+public:
+    SoilMoisture(uint8_t pin, uint32_t sampleRateHz, uint16_t decimation);
+    bool begin(uint16_t dryRaw, uint16_t wetRaw);
+    void end();
+
+    bool isValid() const { return valid; }
+    uint16_t getMoisturePermille() const { return latestPermille; }
+    uint16_t getRaw() const { return latestRaw; }
+};
+
+#endif
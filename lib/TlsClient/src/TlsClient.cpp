@@ -0,0 +1,411 @@
+#include "TlsClient.h"
+#include <Preferences.h>
+#include <mbedtls/error.h>
+
+#define TLS_PREFS_NAMESPACE "tls"
+
+static uint32_t fnv1a(const uint8_t* data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+TlsClient::TlsClient()
+    : ready(false), connectedFlag(false), haveCa(false), haveSession(false), peeked(-1),
+      pskLength(0), sessionHash(0), lastHandshakeMs(0), lastHandshakeHeap(0), setupHeap(0),
+      lastResumed(false), fullHandshakes(0), resumedHandshakes(0) {
+    pskSuites[0] = 0;
+    pskIdentity[0] = '\0';
+    sessionPeer[0] = '\0';
+    mbedtls_net_init(&net);
+    mbedtls_ssl_init(&ssl);
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_x509_crt_init(&caCert);
+    mbedtls_ssl_session_init(&session);
+}
+
+TlsClient::~TlsClient() {
+    stop();
+    mbedtls_ssl_session_free(&session);
+    mbedtls_x509_crt_free(&caCert);
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_config_free(&conf);
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+}
+
+bool TlsClient::checkError(int ret, const char* where) {
+    if (ret == 0) return true;
+    char message[96];
+    mbedtls_strerror(ret, message, sizeof(message));
+    Serial.print("TLS ");
+    Serial.print(where);
+    Serial.print(" failed: ");
+    Serial.println(message);
+    return false;
+}
+
+bool TlsClient::setCACert(const char* pem, size_t length) {
+    // PEM parsing needs the terminating NUL counted in the length
+    int ret = mbedtls_x509_crt_parse(&caCert, (const unsigned char*)pem, length + 1);
+    haveCa = checkError(ret, "CA certificate parse");
+    return haveCa;
+}
+
+bool TlsClient::setPSK(const char* identity, const char* hexKey) {
+    size_t hexLength = strlen(hexKey);
+    if (hexLength == 0 || hexLength % 2 != 0 || hexLength / 2 > TLS_PSK_MAX_LEN ||
+        strlen(identity) >= sizeof(pskIdentity)) {
+        Serial.println("TLS PSK must be 1-32 bytes of hex with a short identity");
+        return false;
+    }
+    for (size_t i = 0; i < hexLength / 2; i++) {
+        int high = hexValue(hexKey[2 * i]);
+        int low = hexValue(hexKey[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            Serial.println("TLS PSK is not valid hex");
+            return false;
+        }
+        pskKey[i] = (high << 4) | low;
+    }
+    pskLength = hexLength / 2;
+    strlcpy(pskIdentity, identity, sizeof(pskIdentity));
+    return true;
+}
+
+bool TlsClient::begin() {
+    if (ready) return true;
+    if (!haveCa && pskLength == 0) {
+        Serial.println("TLS needs a CA certificate or a pre-shared key");
+        return false;
+    }
+
+    uint32_t heapBefore = ESP.getFreeHeap();
+    const char* personalization = "fao56-pump";
+    int ret = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                    (const unsigned char*)personalization, strlen(personalization));
+    if (!checkError(ret, "RNG seed")) return false;
+
+    ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT);
+    if (!checkError(ret, "config")) return false;
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+
+    if (haveCa) {
+        mbedtls_ssl_conf_ca_chain(&conf, &caCert, NULL);
+        mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else {
+        // Nothing to verify a certificate against, so certificate suites
+        // must not be offered at all: the PSK alone authenticates the broker
+        if (!restrictToPskSuites()) {
+            Serial.println("TLS has no certificate-free PSK ciphersuites");
+            return false;
+        }
+        mbedtls_ssl_conf_ciphersuites(&conf, pskSuites);
+        mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+
+    if (pskLength > 0) {
+#if defined(MBEDTLS_KEY_EXCHANGE_SOME_PSK_ENABLED)
+        ret = mbedtls_ssl_conf_psk(&conf, pskKey, pskLength, (const unsigned char*)pskIdentity,
+                                   strlen(pskIdentity));
+        if (!checkError(ret, "PSK setup")) return false;
+#else
+        Serial.println("TLS PSK not supported by this mbedTLS build");
+        return false;
+#endif
+    }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    mbedtls_ssl_conf_max_frag_len(&conf, TLS_MAX_FRAG_LEN);
+#endif
+
+    ret = mbedtls_ssl_setup(&ssl, &conf);
+    if (!checkError(ret, "SSL setup")) return false;
+
+    setupHeap = (int32_t)heapBefore - (int32_t)ESP.getFreeHeap();
+    ready = true;
+    loadSession();
+    return true;
+}
+
+bool TlsClient::restrictToPskSuites() {
+    size_t count = 0;
+    for (const int* id = mbedtls_ssl_list_ciphersuites(); *id != 0 && count < TLS_MAX_PSK_SUITES; id++) {
+        const mbedtls_ssl_ciphersuite_t* info = mbedtls_ssl_ciphersuite_from_id(*id);
+        if (info == NULL) continue;
+        // RSA-PSK is left out: it still relies on the broker's certificate
+        if (info->key_exchange == MBEDTLS_KEY_EXCHANGE_PSK ||
+            info->key_exchange == MBEDTLS_KEY_EXCHANGE_DHE_PSK ||
+            info->key_exchange == MBEDTLS_KEY_EXCHANGE_ECDHE_PSK) {
+            pskSuites[count++] = *id;
+        }
+    }
+    pskSuites[count] = 0;
+    return count > 0;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port) {
+    return connect(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(const char* host, uint16_t port) {
+    if (!ready) return 0;
+    stop();
+
+    char portText[8];
+    snprintf(portText, sizeof(portText), "%u", port);
+    int ret = mbedtls_net_connect(&net, host, portText, MBEDTLS_NET_PROTO_TCP);
+    if (!checkError(ret, "TCP connect")) return 0;
+    mbedtls_net_set_nonblock(&net);
+
+    ret = mbedtls_ssl_set_hostname(&ssl, host);
+    if (!checkError(ret, "hostname")) {
+        stop();
+        return 0;
+    }
+    mbedtls_ssl_set_bio(&ssl, &net, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+    char peer[sizeof(sessionPeer)];
+    snprintf(peer, sizeof(peer), "%s:%u", host, port);
+    bool offered = haveSession && strcmp(peer, sessionPeer) == 0;
+    if (offered) {
+        mbedtls_ssl_set_session(&ssl, &session);
+    }
+
+    uint32_t heapBefore = ESP.getFreeHeap();
+    uint32_t start = millis();
+    if (!handshake()) {
+        if (offered) {
+            // Never retry with a session the broker choked on, not even
+            // after a reboot
+            forgetSession();
+        }
+        stop();
+        return 0;
+    }
+    lastHandshakeMs = millis() - start;
+    lastHandshakeHeap = (int32_t)heapBefore - (int32_t)ESP.getFreeHeap();
+
+    // A resumed session (by ID or ticket) keeps the master secret of the one
+    // we offered; a full handshake derives a new one. The session ID is no
+    // use here: with tickets mbedTLS offers a fresh random ID each time.
+    lastResumed = false;
+    if (offered) {
+        mbedtls_ssl_session current;
+        mbedtls_ssl_session_init(&current);
+        if (mbedtls_ssl_get_session(&ssl, &current) == 0) {
+            lastResumed = memcmp(current.master, session.master, sizeof(session.master)) == 0;
+        }
+        mbedtls_ssl_session_free(&current);
+    }
+
+    if (lastResumed) {
+        resumedHandshakes++;
+    } else {
+        fullHandshakes++;
+    }
+    // A resumed handshake may still carry a fresh ticket; saveSession()
+    // skips the flash write when nothing changed
+    keepSession(peer);
+
+    Serial.print("TLS ");
+    Serial.print(lastResumed ? "resumed" : "full");
+    Serial.print(" handshake: ");
+    Serial.print(lastHandshakeMs);
+    Serial.print(" ms, ");
+    Serial.print(lastHandshakeHeap);
+    Serial.print(" bytes heap, ");
+    Serial.println(mbedtls_ssl_get_ciphersuite(&ssl));
+
+    connectedFlag = true;
+    return 1;
+}
+
+bool TlsClient::handshake() {
+    uint32_t start = millis();
+    int ret;
+    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            checkError(ret, "handshake");
+            return false;
+        }
+        if (millis() - start > TLS_HANDSHAKE_TIMEOUT_MS) {
+            Serial.println("TLS handshake timed out");
+            return false;
+        }
+        delay(2);
+    }
+    return true;
+}
+
+void TlsClient::keepSession(const char* peer) {
+    mbedtls_ssl_session_free(&session);
+    mbedtls_ssl_session_init(&session);
+    haveSession = mbedtls_ssl_get_session(&ssl, &session) == 0;
+    if (haveSession) {
+        strlcpy(sessionPeer, peer, sizeof(sessionPeer));
+        saveSession();
+    }
+}
+
+void TlsClient::loadSession() {
+    static uint8_t blob[TLS_SESSION_BLOB_SIZE];
+    Preferences prefs;
+    if (!prefs.begin(TLS_PREFS_NAMESPACE, true)) return;
+
+    size_t length = prefs.getBytes("session", blob, sizeof(blob));
+    prefs.getString("peer", sessionPeer, sizeof(sessionPeer));
+    prefs.end();
+
+    if (length == 0) return;
+    if (mbedtls_ssl_session_load(&session, blob, length) == 0) {
+        haveSession = true;
+        sessionHash = fnv1a(blob, length);
+        Serial.println("TLS session restored from flash");
+    } else {
+        forgetSession();
+    }
+}
+
+void TlsClient::forgetSession() {
+    haveSession = false;
+    sessionHash = 0;
+    sessionPeer[0] = '\0';
+
+    Preferences prefs;
+    if (!prefs.begin(TLS_PREFS_NAMESPACE, false)) return;
+    prefs.clear();
+    prefs.end();
+}
+
+void TlsClient::saveSession() {
+    static uint8_t blob[TLS_SESSION_BLOB_SIZE];
+    size_t length = 0;
+    if (mbedtls_ssl_session_save(&session, blob, sizeof(blob), &length) != 0) {
+        return;
+    }
+
+    // Only touch flash when the broker actually issued a new session
+    uint32_t hash = fnv1a(blob, length);
+    if (hash == sessionHash) return;
+
+    Preferences prefs;
+    if (!prefs.begin(TLS_PREFS_NAMESPACE, false)) return;
+    prefs.putBytes("session", blob, length);
+    prefs.putString("peer", sessionPeer);
+    prefs.end();
+    sessionHash = hash;
+}
+
+size_t TlsClient::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+size_t TlsClient::write(const uint8_t* buf, size_t size) {
+    if (!connectedFlag) return 0;
+
+    size_t written = 0;
+    uint32_t start = millis();
+    while (written < size) {
+        int ret = mbedtls_ssl_write(&ssl, buf + written, size - written);
+        if (ret > 0) {
+            written += ret;
+        } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            if (millis() - start > TLS_HANDSHAKE_TIMEOUT_MS) break;
+            delay(1);
+        } else {
+            checkError(ret, "write");
+            stop();
+            break;
+        }
+    }
+    return written;
+}
+
+int TlsClient::available() {
+    if (!connectedFlag) return 0;
+
+    // Zero-length read pulls pending records off the socket without blocking
+    int ret = mbedtls_ssl_read(&ssl, NULL, 0);
+    if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        if (ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            checkError(ret, "read");
+        }
+        stop();
+        return 0;
+    }
+    return mbedtls_ssl_get_bytes_avail(&ssl) + (peeked >= 0 ? 1 : 0);
+}
+
+int TlsClient::read() {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsClient::read(uint8_t* buf, size_t size) {
+    if (!connectedFlag || size == 0) return -1;
+
+    size_t offset = 0;
+    if (peeked >= 0) {
+        buf[offset++] = (uint8_t)peeked;
+        peeked = -1;
+        if (offset == size) return offset;
+    }
+
+    int ret = mbedtls_ssl_read(&ssl, buf + offset, size - offset);
+    if (ret > 0) {
+        return offset + ret;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        stop();
+    }
+    return offset > 0 ? (int)offset : -1;
+}
+
+int TlsClient::peek() {
+    if (peeked < 0) {
+        uint8_t b;
+        if (read(&b, 1) == 1) {
+            peeked = b;
+        }
+    }
+    return peeked;
+}
+
+void TlsClient::flush() {
+}
+
+void TlsClient::stop() {
+    if (connectedFlag) {
+        mbedtls_ssl_close_notify(&ssl);
+    }
+    connectedFlag = false;
+    peeked = -1;
+    mbedtls_net_free(&net);
+    if (ready) {
+        // Keeps the record buffers allocated for the next connection
+        mbedtls_ssl_session_reset(&ssl);
+    }
+}
+
+uint8_t TlsClient::connected() {
+    if (connectedFlag) {
+        available();
+    }
+    return connectedFlag;
+}
@@ -0,0 +1,104 @@
+#ifndef TLSCLIENT_H
+#define TLSCLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/ssl_ciphersuites.h>
+
+// Largest record the broker may send us; negotiated with the max_fragment_length
+// extension. Smaller values save RAM on frameworks built with dynamic mbedTLS
+// buffers. Override with -DTLS_MAX_FRAG_LEN=... in build_flags.
+#ifndef TLS_MAX_FRAG_LEN
+#define TLS_MAX_FRAG_LEN MBEDTLS_SSL_MAX_FRAG_LEN_2048
+#endif
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+#define TLS_SESSION_BLOB_SIZE 2048
+#define TLS_PSK_MAX_LEN 32
+#define TLS_PSK_IDENTITY_MAX_LEN 64
+#define TLS_MAX_PSK_SUITES 48
+
+// Arduino Client over mbedTLS with session resumption. The SSL context and
+// its record buffers are set up once in begin() and reset between
+// connections, so reconnecting does not reallocate them. After each full
+// handshake the session (ID and ticket) is kept for the next connect and
+// saved to NVS, so even the first connection after a reboot can resume.
+class TlsClient : public Client {
+private:
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_x509_crt caCert;
+    mbedtls_ssl_session session;
+
+    bool ready;
+    bool connectedFlag;
+    bool haveCa;
+    bool haveSession;
+    int peeked;
+
+    // Without a CA, only these (certificate-free) suites are offered;
+    // mbedTLS keeps a pointer, so the list lives here. Zero-terminated.
+    int pskSuites[TLS_MAX_PSK_SUITES + 1];
+    uint8_t pskKey[TLS_PSK_MAX_LEN];
+    size_t pskLength;
+    char pskIdentity[TLS_PSK_IDENTITY_MAX_LEN];
+    char sessionPeer[96];
+    uint32_t sessionHash;
+
+    uint32_t lastHandshakeMs;
+    int32_t lastHandshakeHeap;
+    int32_t setupHeap;
+    bool lastResumed;
+    uint32_t fullHandshakes;
+    uint32_t resumedHandshakes;
+
+    bool handshake();
+    void keepSession(const char* peer);
+    void loadSession();
+    void saveSession();
+    void forgetSession();
+    bool restrictToPskSuites();
+    bool checkError(int ret, const char* where);
+
+public:
+    TlsClient();
+    ~TlsClient();
+
+    // Configure before begin(). At least one is required.
+    bool setCACert(const char* pem, size_t length);
+    bool setPSK(const char* identity, const char* hexKey);
+    bool begin();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t* buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+
+    // Measurements for the most recent handshake
+    uint32_t getHandshakeMs() const { return lastHandshakeMs; }
+    int32_t getHandshakeHeap() const { return lastHandshakeHeap; }
+    bool wasResumed() const { return lastResumed; }
+    uint32_t getFullHandshakes() const { return fullHandshakes; }
+    uint32_t getResumedHandshakes() const { return resumedHandshakes; }
+    // Heap held by the TLS client: contexts and record buffers from begin()
+    // plus what the last handshake kept (peer certificate, session)
+    int32_t getHeapUsage() const { return setupHeap + lastHandshakeHeap; }
+};
+
+#endif
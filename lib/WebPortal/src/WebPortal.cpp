@@ -1,4 +1,7 @@
 #include "WebPortal.h"
+#include "config.h"
+
+#define CA_CERT_FILE "/ca.pem"
 
 WebPortal::WebPortal() : server(80), portalActive(false) {
     // Initialize default config
@@ -9,6 +12,17 @@ WebPortal::WebPortal() : server(80), portalActive(false) {
     config.mqttPort = 1883;
     config.mqttTopicSub = "topic/pump/command";
     config.mqttTopicPub = "topic/pump/status";
+    config.closedLoop = false;
+    config.fieldCapacity = defaultFieldCapacity;
+    config.traceEnabled = false;
+    config.leaseEnabled = false;
+    config.leaseTopic = "topic/pump/lease";
+    config.leaseBudget = 1;
+    config.leaseUnits = 1;
+    config.leaseWait = 300;
+    config.mqttTls = false;
+    config.pskIdentity = "";
+    config.pskKey = "";
 }
 
 bool WebPortal::begin() {
@@ -42,6 +56,17 @@ bool WebPortal::loadConfig() {
     config.mqttPort = doc["mqttPort"] | 1883;
     config.mqttTopicSub = doc["mqttTopicSub"].as<String>();
     config.mqttTopicPub = doc["mqttTopicPub"].as<String>();
+    config.closedLoop = doc["closedLoop"] | false;
+    config.fieldCapacity = constrain(doc["fieldCapacity"] | defaultFieldCapacity, 1, 100);
+    config.traceEnabled = doc["traceEnabled"] | false;
+    config.leaseEnabled = doc["leaseEnabled"] | false;
+    config.leaseTopic = doc["leaseTopic"] | "topic/pump/lease";
+    config.leaseBudget = doc["leaseBudget"] | 1;
+    config.leaseUnits = doc["leaseUnits"] | 1;
+    config.leaseWait = doc["leaseWait"] | 300;
+    config.mqttTls = doc["mqttTls"] | false;
+    config.pskIdentity = doc["pskIdentity"] | "";
+    config.pskKey = doc["pskKey"] | "";
     
     Serial.println("Config loaded successfully");
     return true;
@@ -62,6 +87,17 @@ bool WebPortal::saveConfig() {
     doc["mqttPort"] = config.mqttPort;
     doc["mqttTopicSub"] = config.mqttTopicSub;
     doc["mqttTopicPub"] = config.mqttTopicPub;
+    doc["closedLoop"] = config.closedLoop;
+    doc["fieldCapacity"] = config.fieldCapacity;
+    doc["traceEnabled"] = config.traceEnabled;
+    doc["leaseEnabled"] = config.leaseEnabled;
+    doc["leaseTopic"] = config.leaseTopic;
+    doc["leaseBudget"] = config.leaseBudget;
+    doc["leaseUnits"] = config.leaseUnits;
+    doc["leaseWait"] = config.leaseWait;
+    doc["mqttTls"] = config.mqttTls;
+    doc["pskIdentity"] = config.pskIdentity;
+    doc["pskKey"] = config.pskKey;
     
     serializeJson(doc, file);
     file.close();
@@ -70,6 +106,16 @@ bool WebPortal::saveConfig() {
     return true;
 }
 
+String WebPortal::loadCACert() {
+    File file = SPIFFS.open(CA_CERT_FILE, "r");
+    if (!file) {
+        return "";
+    }
+    String pem = file.readString();
+    file.close();
+    return pem;
+}
+
 bool WebPortal::isConfigValid() {
     return (config.deviceId.length() > 0 && 
             config.wifiSSID.length() > 0 && 
@@ -94,6 +140,7 @@ void WebPortal::startPortal() {
     server.on("/", [this]() { handleRoot(); });
     server.on("/save", HTTP_POST, [this]() { handleSave(); });
     server.on("/reset", [this]() { handleReset(); });
+    server.on("/trace", [this]() { handleTrace(); });
     
     server.begin();
     portalActive = true;
@@ -131,6 +178,24 @@ void WebPortal::handleSave() {
     config.mqttPort = server.arg("mqttPort").toInt();
     config.mqttTopicSub = server.arg("mqttTopicSub");
     config.mqttTopicPub = server.arg("mqttTopicPub");
+    config.closedLoop = server.hasArg("closedLoop");
+    config.traceEnabled = server.hasArg("traceEnabled");
+    config.leaseEnabled = server.hasArg("leaseEnabled");
+    if (server.arg("leaseTopic").length() > 0) {
+        config.leaseTopic = server.arg("leaseTopic");
+    }
+    config.leaseBudget = max(1L, server.arg("leaseBudget").toInt());
+    config.leaseUnits = max(1L, server.arg("leaseUnits").toInt());
+    config.leaseWait = max(1L, server.arg("leaseWait").toInt());
+    if (server.hasArg("fieldCapacity")) {
+        config.fieldCapacity = constrain(server.arg("fieldCapacity").toInt(), 1, 100);
+    }
+    config.mqttTls = server.hasArg("mqttTls");
+    config.pskIdentity = server.arg("pskIdentity");
+    String newPskKey = server.arg("pskKey");
+    String newCaCert = server.arg("caCert");
+    newCaCert.trim();
+    bool clearCaCert = server.hasArg("caClear");
     
     // Only update password if a new one is provided
     if (newPassword.length() > 0) {
@@ -153,6 +218,56 @@ void WebPortal::handleSave() {
         return;
     }
     
+    // The firmware copies these into fixed buffers; refuse rather than truncate
+    if (config.deviceId.length() >= ID_BUFFER_SIZE || config.wifiSSID.length() >= SSID_BUFFER_SIZE ||
+        config.wifiPassword.length() >= SECRET_BUFFER_SIZE || config.mqttServer.length() >= HOST_BUFFER_SIZE ||
+        config.mqttTopicSub.length() >= TOPIC_BUFFER_SIZE || config.mqttTopicPub.length() >= TOPIC_BUFFER_SIZE ||
+        config.leaseTopic.length() >= TOPIC_BUFFER_SIZE) {
+        server.send(400, "text/html", 
+            "<html><body><h2>Error: A field is too long!</h2>"
+            "<a href='/'>Go Back</a></body></html>");
+        return;
+    }
+    
+    // Like the WiFi password, a blank key or certificate keeps the stored one
+    if (newPskKey.length() > 0) {
+        config.pskKey = newPskKey;
+    }
+    if (config.pskIdentity.length() == 0) {
+        config.pskKey = "";
+    }
+    if (config.pskKey.length() % 2 != 0 || config.pskKey.length() > 64) {
+        server.send(400, "text/html", 
+            "<html><body><h2>Error: PSK must be up to 32 bytes in hex!</h2>"
+            "<a href='/'>Go Back</a></body></html>");
+        return;
+    }
+    if (newCaCert.length() > 0 && !newCaCert.startsWith("-----BEGIN CERTIFICATE-----")) {
+        server.send(400, "text/html", 
+            "<html><body><h2>Error: CA certificate must be in PEM format!</h2>"
+            "<a href='/'>Go Back</a></body></html>");
+        return;
+    }
+    
+    // TLS needs something to authenticate the broker with
+    bool haveCaCert = newCaCert.length() > 0 || (!clearCaCert && SPIFFS.exists(CA_CERT_FILE));
+    if (config.mqttTls && !haveCaCert && config.pskKey.length() == 0) {
+        server.send(400, "text/html", 
+            "<html><body><h2>Error: TLS needs a CA certificate or a PSK!</h2>"
+            "<a href='/'>Go Back</a></body></html>");
+        return;
+    }
+    
+    if (newCaCert.length() > 0) {
+        File file = SPIFFS.open(CA_CERT_FILE, "w");
+        if (file) {
+            file.print(newCaCert);
+            file.close();
+        }
+    } else if (clearCaCert) {
+        SPIFFS.remove(CA_CERT_FILE);
+    }
+    
     // Save configuration
     if (saveConfig()) {
         server.send(200, "text/html", 
@@ -173,6 +288,7 @@ void WebPortal::handleSave() {
 
 void WebPortal::handleReset() {
     SPIFFS.remove("/config.json");
+    SPIFFS.remove(CA_CERT_FILE);
     server.send(200, "text/html", 
         "<html><body><h2>Configuration Reset!</h2>"
         "<p>Device will restart in 3 seconds...</p>"
@@ -183,8 +299,31 @@ void WebPortal::handleReset() {
     ESP.restart();
 }
 
+void WebPortal::handleTrace() {
+    // Oldest segment first so the download is in time order
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "text/plain", "");
+    
+    const char* segments[] = { TRACE_OLD_FILE, TRACE_FILE };
+    uint8_t buffer[512];
+    for (const char* path : segments) {
+        File file = SPIFFS.open(path, "r");
+        if (!file) continue;
+        while (file.available()) {
+            size_t n = file.read(buffer, sizeof(buffer));
+            server.sendContent((const char*)buffer, n);
+        }
+        file.close();
+    }
+    server.sendContent("");
+}
+
 void WebPortal::sendHTML() {
-    String html = R"rawliteral(
+    // Streamed in chunks rather than built up as one large String
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "text/html", "");
+    
+    sendChunk(R"rawliteral(
 <!DOCTYPE html>
 <html>
 <head>
@@ -197,7 +336,7 @@ void WebPortal::sendHTML() {
         h1 { color: #2c3e50; text-align: center; margin-bottom: 30px; }
         .form-group { margin-bottom: 20px; }
         label { display: block; margin-bottom: 5px; font-weight: bold; color: #34495e; }
-        input[type="text"], input[type="password"], input[type="number"] { 
+        input[type="text"], input[type="password"], input[type="number"], textarea { 
             width: 100%; padding: 12px; border: 2px solid #bdc3c7; border-radius: 5px; 
             font-size: 16px; box-sizing: border-box; 
         }
@@ -220,55 +359,173 @@ void WebPortal::sendHTML() {
         
         <div class="info">
             <strong>Current Status:</strong><br>
-            Device ID: )rawliteral" + config.deviceId + R"rawliteral(<br>
-            WiFi SSID: )rawliteral" + config.wifiSSID + R"rawliteral(<br>
-            MQTT Server: )rawliteral" + config.mqttServer + R"rawliteral(
+            Device ID: )rawliteral");
+    sendChunk(config.deviceId.c_str());
+    sendChunk(R"rawliteral(<br>
+            WiFi SSID: )rawliteral");
+    sendChunk(config.wifiSSID.c_str());
+    sendChunk(R"rawliteral(<br>
+            MQTT Server: )rawliteral");
+    sendChunk(config.mqttServer.c_str());
+    sendChunk(R"rawliteral(
         </div>
         
         <form action="/save" method="POST">
             <div class="form-group">
                 <label for="deviceId">Device ID:</label>
-                <input type="text" id="deviceId" name="deviceId" value=")rawliteral" + config.deviceId + R"rawliteral(" placeholder="P-1" required>
+                <input type="text" id="deviceId" name="deviceId" maxlength=")rawliteral");
+    sendNumber(ID_BUFFER_SIZE - 1);
+    sendChunk(R"rawliteral(" value=")rawliteral");
+    sendChunk(config.deviceId.c_str());
+    sendChunk(R"rawliteral(" placeholder="P-1" required>
             </div>
             
             <div class="form-group">
                 <label for="wifiSSID">WiFi SSID:</label>
-                <input type="text" id="wifiSSID" name="wifiSSID" value=")rawliteral" + config.wifiSSID + R"rawliteral(" placeholder="Your WiFi Network" required>
+                <input type="text" id="wifiSSID" name="wifiSSID" maxlength=")rawliteral");
+    sendNumber(SSID_BUFFER_SIZE - 1);
+    sendChunk(R"rawliteral(" value=")rawliteral");
+    sendChunk(config.wifiSSID.c_str());
+    sendChunk(R"rawliteral(" placeholder="Your WiFi Network" required>
             </div>
             
             <div class="form-group">
                 <label for="wifiPassword">WiFi Password:</label>
-                <input type="password" id="wifiPassword" name="wifiPassword" value="" placeholder="Enter new password or leave blank to keep current" required>
-                <div class="password-hint">)rawliteral";
+                <input type="password" id="wifiPassword" name="wifiPassword" maxlength=")rawliteral");
+    sendNumber(SECRET_BUFFER_SIZE - 1);
+    sendChunk(R"rawliteral(" value="" placeholder="Enter new password or leave blank to keep current" required>
+                <div class="password-hint">)rawliteral");
     
     // Only show password hint if there's an existing password
     if (config.wifiPassword.length() > 0) {
-        html += "Current password is set (hidden for security)";
+        sendChunk("Current password is set (hidden for security)");
     } else {
-        html += "No password currently set";
+        sendChunk("No password currently set");
     }
     
-    html += R"rawliteral(</div>
+    sendChunk(R"rawliteral(</div>
             </div>
             
             <div class="form-group">
                 <label for="mqttServer">MQTT Server IP:</label>
-                <input type="text" id="mqttServer" name="mqttServer" value=")rawliteral" + config.mqttServer + R"rawliteral(" placeholder="192.168.1.100" required>
+                <input type="text" id="mqttServer" name="mqttServer" maxlength=")rawliteral");
+    sendNumber(HOST_BUFFER_SIZE - 1);
+    sendChunk(R"rawliteral(" value=")rawliteral");
+    sendChunk(config.mqttServer.c_str());
+    sendChunk(R"rawliteral(" placeholder="192.168.1.100" required>
             </div>
             
             <div class="form-group">
                 <label for="mqttPort">MQTT Port:</label>
-                <input type="number" id="mqttPort" name="mqttPort" value=")rawliteral" + String(config.mqttPort) + R"rawliteral(" placeholder="1883">
+                <input type="number" id="mqttPort" name="mqttPort" value=")rawliteral");
+    sendNumber(config.mqttPort);
+    sendChunk(R"rawliteral(" placeholder="1883">
             </div>
             
             <div class="form-group">
                 <label for="mqttTopicSub">MQTT Subscribe Topic:</label>
-                <input type="text" id="mqttTopicSub" name="mqttTopicSub" value=")rawliteral" + config.mqttTopicSub + R"rawliteral(" placeholder="topic/pump/command">
+                <input type="text" id="mqttTopicSub" name="mqttTopicSub" maxlength=")rawliteral");
+    sendNumber(TOPIC_BUFFER_SIZE - 1);
+    sendChunk(R"rawliteral(" value=")rawliteral");
+    sendChunk(config.mqttTopicSub.c_str());
+    sendChunk(R"rawliteral(" placeholder="topic/pump/command">
             </div>
             
             <div class="form-group">
                 <label for="mqttTopicPub">MQTT Publish Topic:</label>
-                <input type="text" id="mqttTopicPub" name="mqttTopicPub" value=")rawliteral" + config.mqttTopicPub + R"rawliteral(" placeholder="topic/pump/status">
+                <input type="text" id="mqttTopicPub" name="mqttTopicPub" maxlength=")rawliteral");
+    sendNumber(TOPIC_BUFFER_SIZE - 1);
+    sendChunk(R"rawliteral(" value=")rawliteral");
+    sendChunk(config.mqttTopicPub.c_str());
+    sendChunk(R"rawliteral(" placeholder="topic/pump/status">
+            </div>
+            
+            <div class="form-group">
+                <label for="closedLoop"><input type="checkbox" id="closedLoop" name="closedLoop")rawliteral");
+    sendChunk(config.closedLoop ? " checked" : "");
+    sendChunk(R"rawliteral(> Stop early at field capacity</label>
+            </div>
+            
+            <div class="form-group">
+                <label for="fieldCapacity">Field Capacity (% soil moisture):</label>
+                <input type="number" id="fieldCapacity" name="fieldCapacity" min="1" max="100" value=")rawliteral");
+    sendNumber(config.fieldCapacity);
+    sendChunk(R"rawliteral(" placeholder=")rawliteral");
+    sendNumber(defaultFieldCapacity);
+    sendChunk(R"rawliteral(">
+            </div>
+            
+            <div class="form-group">
+                <label for="traceEnabled"><input type="checkbox" id="traceEnabled" name="traceEnabled")rawliteral");
+    sendChunk(config.traceEnabled ? " checked" : "");
+    sendChunk(R"rawliteral(> Capture command trace</label>
+                <div class="password-hint"><a href="/trace">Download trace</a></div>
+            </div>
+            
+            <div class="form-group">
+                <label for="leaseEnabled"><input type="checkbox" id="leaseEnabled" name="leaseEnabled")rawliteral");
+    sendChunk(config.leaseEnabled ? " checked" : "");
+    sendChunk(R"rawliteral(> Share water supply capacity (lease before start)</label>
+            </div>
+            
+            <div class="form-group">
+                <label for="leaseTopic">Lease Topic Prefix:</label>
+                <input type="text" id="leaseTopic" name="leaseTopic" maxlength=")rawliteral");
+    sendNumber(TOPIC_BUFFER_SIZE - 1);
+    sendChunk(R"rawliteral(" value=")rawliteral");
+    sendChunk(config.leaseTopic.c_str());
+    sendChunk(R"rawliteral(" placeholder="topic/pump/lease">
+            </div>
+            
+            <div class="form-group">
+                <label for="leaseBudget">Supply Budget (units, same on all pumps):</label>
+                <input type="number" id="leaseBudget" name="leaseBudget" min="1" value=")rawliteral");
+    sendNumber(config.leaseBudget);
+    sendChunk(R"rawliteral(" placeholder="1">
+            </div>
+            
+            <div class="form-group">
+                <label for="leaseUnits">This Pump's Draw (units):</label>
+                <input type="number" id="leaseUnits" name="leaseUnits" min="1" value=")rawliteral");
+    sendNumber(config.leaseUnits);
+    sendChunk(R"rawliteral(" placeholder="1">
+            </div>
+            
+            <div class="form-group">
+                <label for="leaseWait">Max Lease Wait (seconds):</label>
+                <input type="number" id="leaseWait" name="leaseWait" min="1" value=")rawliteral");
+    sendNumber(config.leaseWait);
+    sendChunk(R"rawliteral(" placeholder="300">
+            </div>
+            
+            <div class="form-group">
+                <label for="mqttTls"><input type="checkbox" id="mqttTls" name="mqttTls")rawliteral");
+    sendChunk(config.mqttTls ? " checked" : "");
+    sendChunk(R"rawliteral(> Connect to MQTT over TLS (usually port 8883)</label>
+            </div>
+            
+            <div class="form-group">
+                <label for="caCert">Broker CA Certificate (PEM):</label>
+                <textarea id="caCert" name="caCert" rows="6" placeholder="Paste new certificate or leave blank to keep current"></textarea>
+                <div class="password-hint">)rawliteral");
+    sendChunk(SPIFFS.exists(CA_CERT_FILE) ? "A CA certificate is stored" : "No CA certificate stored");
+    sendChunk(R"rawliteral(</div>
+                <label for="caClear"><input type="checkbox" id="caClear" name="caClear"> Remove stored certificate</label>
+            </div>
+            
+            <div class="form-group">
+                <label for="pskIdentity">TLS PSK Identity:</label>
+                <input type="text" id="pskIdentity" name="pskIdentity" value=")rawliteral");
+    sendChunk(config.pskIdentity.c_str());
+    sendChunk(R"rawliteral(" placeholder="leave blank to use the certificate only">
+            </div>
+            
+            <div class="form-group">
+                <label for="pskKey">TLS PSK Key (hex):</label>
+                <input type="password" id="pskKey" name="pskKey" value="" placeholder="Enter new key or leave blank to keep current">
+                <div class="password-hint">)rawliteral");
+    sendChunk(config.pskKey.length() > 0 ? "Current key is set (hidden for security)" : "No key currently set");
+    sendChunk(R"rawliteral(</div>
             </div>
             
             <div class="button-group">
@@ -279,7 +536,16 @@ void WebPortal::sendHTML() {
     </div>
 </body>
 </html>
-)rawliteral";
-    
-    server.send(200, "text/html", html);
-}
\ No newline at end of file
+)rawliteral");
+    server.sendContent("");
+}
+
+void WebPortal::sendChunk(const char* text) {
+    server.sendContent(text, strlen(text));
+}
+
+void WebPortal::sendNumber(long value) {
+    char text[12];
+    snprintf(text, sizeof(text), "%ld", value);
+    sendChunk(text);
+}
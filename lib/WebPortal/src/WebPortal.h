@@ -20,6 +20,17 @@ private:
         int mqttPort;
         String mqttTopicSub;
         String mqttTopicPub;
+        bool closedLoop;
+        int fieldCapacity;
+        bool traceEnabled;
+        bool leaseEnabled;
+        String leaseTopic;
+        int leaseBudget;
+        int leaseUnits;
+        int leaseWait;
+        bool mqttTls;
+        String pskIdentity;
+        String pskKey;
     };
     
     Config config;
@@ -27,7 +38,10 @@ private:
     void handleRoot();
     void handleSave();
     void handleReset();
+    void handleTrace();
     void sendHTML();
+    void sendChunk(const char* text);
+    void sendNumber(long value);
     
 public:
     WebPortal();
@@ -48,6 +62,18 @@ public:
     int getMqttPort() { return config.mqttPort; }
     String getMqttTopicSub() { return config.mqttTopicSub; }
     String getMqttTopicPub() { return config.mqttTopicPub; }
+    bool getClosedLoop() { return config.closedLoop; }
+    int getFieldCapacity() { return config.fieldCapacity; }
+    bool getTraceEnabled() { return config.traceEnabled; }
+    bool getLeaseEnabled() { return config.leaseEnabled; }
+    String getLeaseTopic() { return config.leaseTopic; }
+    int getLeaseBudget() { return config.leaseBudget; }
+    int getLeaseUnits() { return config.leaseUnits; }
+    int getLeaseWait() { return config.leaseWait; }
+    bool getMqttTls() { return config.mqttTls; }
+    String getPskIdentity() { return config.pskIdentity; }
+    String getPskKey() { return config.pskKey; }
+    String loadCACert();
 };
 
 #endif
\ No newline at end of file
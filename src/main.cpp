@@ -1,42 +1,68 @@
 #include "config.h"
 #include "WebPortal.h"
+#include "SoilMoisture.h"
+#include "PumpStateMachine.h"
+#include "CapacityLease.h"
+#include "ArenaAllocator.h"
+#include "TlsClient.h"
 #include <WiFi.h>
+#include <SPIFFS.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include <time.h>
+#include <sys/time.h>
 
 #define CONFIG_BUTTON_PIN 0  // GPIO 0 (BOOT button)
 
-// System states
-enum PumpState {
-    IDLE,
-    IRRIGATING,
-    EMERGENCY_HALT,
-    FAULT
-};
-
 // Global variables
-PumpState currentState = IDLE;
-unsigned long irrigationStartTime = 0;
-unsigned long irrigationDuration = 0;
-unsigned long remainingTime = 0;
+PumpStateMachine pump(minIrrMinutes, maxIrrMinutes);
 bool pumpActive = false;
 unsigned long lastButtonCheck = 0;
 bool buttonPressed = false;
 
 WiFiClient espClient;
+TlsClient tlsClient;
 PubSubClient client(espClient);
-JsonDocument doc;
 WebPortal portal;
+SoilMoisture soil(SOIL_SENSOR_PIN, SOIL_SAMPLE_RATE_HZ, SOIL_DECIMATION);
+FieldCapacityDetector fieldCapacity;
+CapacityLease lease;
+
+// Capacity lease bookkeeping
+bool leasePending = false;      // an "On" is waiting for supply capacity
+float pendingIrrTime = 0;
+unsigned long leaseRequestedAt = 0;
+unsigned long lastLeaseWait = 0;
+unsigned long leaseTimeouts = 0;
+unsigned long lastLeaseEcho = 0;  // our own renewal came back from the broker
 
-// Dynamic configuration variables
-String deviceId;
-String wifiSSID;
-String wifiPassword;
-String mqttServer;
+// JSON documents live in fixed arenas; separate documents so publishStatus()
+// can run while the callback still holds pointers into the command
+ArenaAllocator<JSON_ARENA_SIZE> commandArena;
+ArenaAllocator<JSON_ARENA_SIZE> statusArena;
+JsonDocument commandDoc(&commandArena);
+JsonDocument statusDoc(&statusArena);
+char statusBuffer[STATUS_BUFFER_SIZE];
+File traceFile;
+
+// Dynamic configuration variables, copied out of the portal once at startup
+char deviceId[ID_BUFFER_SIZE];
+char wifiSSID[SSID_BUFFER_SIZE];
+char wifiPassword[SECRET_BUFFER_SIZE];
+char mqttServer[HOST_BUFFER_SIZE];
 int mqttPort;
-String mqttTopicSub;
-String mqttTopicPub;
+char mqttTopicSub[TOPIC_BUFFER_SIZE];
+char mqttTopicPub[TOPIC_BUFFER_SIZE];
+bool closedLoop;
+bool traceEnabled;
+bool leaseEnabled;
+bool mqttTls;
+char leaseTopic[TOPIC_BUFFER_SIZE];
+
+// Derived names, built once instead of on every reconnect/publish
+char clientId[ID_BUFFER_SIZE + 16];
+char leaseSelfTopic[TOPIC_BUFFER_SIZE + ID_BUFFER_SIZE];
+char leaseWildcard[TOPIC_BUFFER_SIZE + 2];
 
 // Function declarations
 void setupWiFi();
@@ -49,6 +75,16 @@ void publishStatus();
 bool isIrrigationTime();
 void setupTime();
 void checkConfigButton();
+void writeTraceEvent(const TraceEvent& event, void* context);
+void handleLease();
+void publishLease(const char* payload, size_t length);
+void releaseLease();
+bool brokerLost();
+void pauseForLease();
+uint16_t keepAliveSec();
+uint64_t epochMillis();
+bool setupTls();
+void copyConfig(char* dest, size_t size, const String& value, const char* name);
 
 void setup() {
     Serial.begin(115200);
@@ -74,18 +110,61 @@ void setup() {
     }
     
     // Get configuration values
-    deviceId = portal.getDeviceId();
-    wifiSSID = portal.getWifiSSID();
-    wifiPassword = portal.getWifiPassword();
-    mqttServer = portal.getMqttServer();
+    copyConfig(deviceId, sizeof(deviceId), portal.getDeviceId(), "Device ID");
+    copyConfig(wifiSSID, sizeof(wifiSSID), portal.getWifiSSID(), "WiFi SSID");
+    copyConfig(wifiPassword, sizeof(wifiPassword), portal.getWifiPassword(), "WiFi password");
+    copyConfig(mqttServer, sizeof(mqttServer), portal.getMqttServer(), "MQTT server");
     mqttPort = portal.getMqttPort();
-    mqttTopicSub = portal.getMqttTopicSub();
-    mqttTopicPub = portal.getMqttTopicPub();
+    copyConfig(mqttTopicSub, sizeof(mqttTopicSub), portal.getMqttTopicSub(), "MQTT subscribe topic");
+    copyConfig(mqttTopicPub, sizeof(mqttTopicPub), portal.getMqttTopicPub(), "MQTT publish topic");
+    closedLoop = portal.getClosedLoop();
+    traceEnabled = portal.getTraceEnabled();
+    leaseEnabled = portal.getLeaseEnabled();
+    mqttTls = portal.getMqttTls();
+    copyConfig(leaseTopic, sizeof(leaseTopic), portal.getLeaseTopic(), "Lease topic");
+    fieldCapacity.setThreshold(portal.getFieldCapacity() * 10);
+    
+    snprintf(clientId, sizeof(clientId), "PumpController-%s", deviceId);
+    snprintf(leaseSelfTopic, sizeof(leaseSelfTopic), "%s/%s", leaseTopic, deviceId);
+    snprintf(leaseWildcard, sizeof(leaseWildcard), "%s/+", leaseTopic);
+    if (leaseEnabled && !lease.begin(deviceId, portal.getLeaseBudget(), portal.getLeaseUnits(),
+                                     portal.getLeaseWait() * 1000UL)) {
+        Serial.println("Device ID too long for supply leasing, leasing disabled");
+        leaseEnabled = false;
+    }
+    // Renewals double as a liveness check: each one echoes back to us
+    lease.setRenewInterval(keepAliveSec() * 1000UL / 2);
     
     Serial.println("Configuration loaded:");
-    Serial.println("Device ID: " + deviceId);
-    Serial.println("WiFi SSID: " + wifiSSID);
-    Serial.println("MQTT Server: " + mqttServer);
+    Serial.print("Device ID: ");
+    Serial.println(deviceId);
+    Serial.print("WiFi SSID: ");
+    Serial.println(wifiSSID);
+    Serial.print("MQTT Server: ");
+    Serial.println(mqttServer);
+    
+    // The probe is only sampled when closed-loop stop is enabled, so
+    // controllers without one do not run the ADC stream
+    if (closedLoop && !soil.begin(SOIL_DRY_RAW, SOIL_WET_RAW)) {
+        Serial.println("Soil sensor unavailable, closed-loop stop disabled");
+    }
+    
+    if (traceEnabled) {
+        Serial.println("Command trace capture enabled");
+        traceFile = SPIFFS.open(TRACE_FILE, FILE_APPEND);
+        pump.setTraceCallback(writeTraceEvent, NULL);
+        pump.reset(millis());
+    }
+    
+    // Never fall back to plaintext MQTT when TLS is configured
+    if (mqttTls && !setupTls()) {
+        Serial.println("TLS setup failed, starting portal...");
+        portal.startPortal();
+        while (portal.isPortalActive()) {
+            portal.handle();
+            delay(10);
+        }
+    }
     
     // Setup connections
     setupWiFi();
@@ -98,15 +177,23 @@ void setup() {
     }
     
     Serial.println("Pump Control System Initialized");
+    Serial.print("Free heap after init: ");
+    Serial.println(ESP.getFreeHeap());
     publishStatus();
 }
 
 void loop() {
     // Check config button (only in IDLE state)
-    if (currentState == IDLE) {
+    if (pump.getState() == IDLE) {
         checkConfigButton();
     }
     
+    // Stop before the broker's last-will (1.5 x keep-alive) can hand our
+    // capacity to another controller; resumes once capacity is granted again
+    if (leaseEnabled && lease.getStatus() == CapacityLease::LEASE_HELD && brokerLost()) {
+        pauseForLease();
+    }
+    
     // Handle portal if active
     if (portal.isPortalActive()) {
         portal.handle();
@@ -124,6 +211,9 @@ void loop() {
     }
     client.loop();
     
+    if (leaseEnabled) {
+        handleLease();
+    }
     handleStateTransitions();
     delay(1000);
 }
@@ -151,7 +241,7 @@ void setupWiFi() {
     Serial.println(wifiSSID);
     
     WiFi.mode(WIFI_STA);
-    WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str());
+    WiFi.begin(wifiSSID, wifiPassword);
     
     int attempts = 0;
     while (WiFi.status() != WL_CONNECTED && attempts < 20) {
@@ -190,18 +280,55 @@ void setupTime() {
     }
 }
 
+bool setupTls() {
+    String caCert = portal.loadCACert();
+    if (caCert.length() > 0 && !tlsClient.setCACert(caCert.c_str(), caCert.length())) {
+        return false;
+    }
+    String pskIdentity = portal.getPskIdentity();
+    if (pskIdentity.length() > 0 &&
+        !tlsClient.setPSK(pskIdentity.c_str(), portal.getPskKey().c_str())) {
+        return false;
+    }
+    if (!tlsClient.begin()) {
+        return false;
+    }
+    Serial.print("TLS ready, heap used: ");
+    Serial.println(tlsClient.getHeapUsage());
+    return true;
+}
+
 void setupMQTT() {
-    client.setServer(mqttServer.c_str(), mqttPort);
+    if (mqttTls) {
+        // A longer keep-alive keeps one TLS session up instead of
+        // reconnecting; it also delays the lease last-will (1.5 x keep-alive)
+        client.setClient(tlsClient);
+    }
+    client.setKeepAlive(keepAliveSec());
+    client.setServer(mqttServer, mqttPort);
+    client.setBufferSize(MQTT_BUFFER_SIZE);
     client.setCallback(callback);
 }
 
 void reconnectMQTT() {
     while (!client.connected()) {
         Serial.print("Attempting MQTT connection...");
-        String clientId = "PumpController-" + deviceId;
-        if (client.connect(clientId.c_str())) {
+        bool connected;
+        if (leaseEnabled) {
+            // Empty retained will: the broker releases our lease if we drop off
+            connected = client.connect(clientId, leaseSelfTopic, 1, true, "");
+        } else {
+            connected = client.connect(clientId);
+        }
+        if (connected) {
             Serial.println("connected");
-            client.subscribe(mqttTopicSub.c_str());
+            client.subscribe(mqttTopicSub);
+            if (leaseEnabled) {
+                // Rebuild the lease table from retained messages
+                lease.begin(deviceId, portal.getLeaseBudget(), portal.getLeaseUnits(),
+                            portal.getLeaseWait() * 1000UL);
+                client.subscribe(leaseWildcard);
+            }
         } 
         else {
             Serial.print("failed, rc=");
@@ -213,17 +340,22 @@ void reconnectMQTT() {
 }
 
 void callback(char* topic, byte* payload, unsigned int length) {
-    String message;
-    for (int i = 0; i < length; i++) {
-        message += (char)payload[i];
+    size_t leaseTopicLength = strlen(leaseTopic);
+    if (leaseEnabled && strncmp(topic, leaseTopic, leaseTopicLength) == 0 &&
+        topic[leaseTopicLength] == '/') {
+        if (strcmp(topic + leaseTopicLength + 1, deviceId) == 0) {
+            lastLeaseEcho = millis();
+        }
+        lease.onMessage(topic + leaseTopicLength + 1, (const char*)payload, length, epochMillis());
+        return;
     }
     
     Serial.print("Message received: ");
-    Serial.println(message);
+    Serial.write(payload, length);
+    Serial.println();
     
     // Parse JSON
-    doc.clear();
-    DeserializationError error = deserializeJson(doc, message);
+    DeserializationError error = deserializeJson(commandDoc, payload, length);
     
     if (error) {
         Serial.print("JSON parsing failed: ");
@@ -231,119 +363,113 @@ void callback(char* topic, byte* payload, unsigned int length) {
         return;
     }
     
-    String signal = doc["signal"];
-    float irr_time = doc["irr_time"];
-    String targetId = doc["id"];
+    const char* signal = commandDoc["signal"] | "";
+    float irr_time = commandDoc["irr_time"];
+    const char* targetId = commandDoc["id"] | "";
     
     // Check if message is for this device
-    if (targetId != deviceId) {
+    if (strcmp(targetId, deviceId) != 0) {
         Serial.println("Message not for this device, ignoring...");
         return;
     }
     
     Serial.println("Message is for this device!");
     
-    // Validate irrigation time
-    if (signal == "On" && irr_time <= minIrrMinutes) {
-        Serial.print("Invalid irrigation time: must be greater than ");
-		Serial.println(minIrrMinutes);
-        return;
-    }
+    PumpState previousState = pump.getState();
+    PumpSignal pumpSignal = PumpStateMachine::parseSignal(signal);
+    bool allowed = isIrrigationTime();
     
-    if (signal == "On" && irr_time > maxIrrMinutes) {
-        Serial.print("Irrigation time too long: maximum is ");
-		Serial.print(maxIrrMinutes);
-		Serial.println(" minutes");
-		Serial.print("Received: ");
-		Serial.println(irr_time);
-        return;
+    if (leaseEnabled) {
+        if (pump.wouldStart(pumpSignal, irr_time, allowed)) {
+            // Defer the start until supply capacity is granted
+            if (!leasePending) {
+                leaseRequestedAt = millis();
+            }
+            leasePending = true;
+            pendingIrrTime = irr_time;
+            Serial.println("Waiting for supply capacity lease");
+            publishStatus();
+            return;
+        }
+        if (pumpSignal != SIGNAL_ON && leasePending) {
+            Serial.println("Lease request cancelled");
+            releaseLease();
+        }
     }
     
-    // Handle commands based on current state and signal
-    if (signal == "On" && currentState == IDLE && isIrrigationTime()) {
-        Serial.println("Starting irrigation");
-        irrigationDuration = (unsigned long) (irr_time * 60 * 1000);
-        remainingTime = irrigationDuration;
-        irrigationStartTime = millis();
-        currentState = IRRIGATING;
-        controlPump(true);
-        publishStatus();
-    }
-    else if (signal == "On" && currentState == EMERGENCY_HALT && isIrrigationTime()) {
-        Serial.println("Resuming from emergency halt");
-        irrigationDuration = remainingTime;
-        irrigationStartTime = millis();
-        currentState = IRRIGATING;
-        controlPump(true);
-        publishStatus();
+    CommandResult result = pump.handleCommand(pumpSignal, irr_time, millis(), allowed);
+    
+    switch (result) {
+        case CMD_TIME_TOO_SHORT:
+            Serial.print("Invalid irrigation time: must be greater than ");
+            Serial.println(minIrrMinutes);
+            return;
+            
+        case CMD_TIME_TOO_LONG:
+            Serial.print("Irrigation time too long: maximum is ");
+            Serial.print(maxIrrMinutes);
+            Serial.println(" minutes");
+            Serial.print("Received: ");
+            Serial.println(irr_time);
+            return;
+            
+        case CMD_IGNORED:
+            Serial.println("No conditions met! Checking why:");
+            Serial.print("Signal == 'On'? ");
+            Serial.println(strcmp(signal, "On") == 0);
+            Serial.print("State == IDLE? ");
+            Serial.println(pump.getState() == IDLE);
+            Serial.print("Is irrigation time? ");
+            Serial.println(allowed);
+            return;
+            
+        case CMD_ACCEPTED:
+            break;
     }
-    else if (signal == "Emergency Halt" && currentState == IRRIGATING) {
+    
+    if (pump.getState() == IRRIGATING) {
+        Serial.println(previousState == EMERGENCY_HALT ? "Resuming from emergency halt" : "Starting irrigation");
+        fieldCapacity.reset();
+    } else if (pump.getState() == EMERGENCY_HALT) {
         Serial.println("Emergency halt");
-        unsigned long elapsed = millis() - irrigationStartTime;
-        remainingTime = irrigationDuration - elapsed;
-        currentState = EMERGENCY_HALT;
-        controlPump(false);
-        publishStatus();
-    }
-    else if (signal == "Stop") {
+    } else {
         Serial.println("Stopping");
-        currentState = IDLE;
-        irrigationDuration = 0;
-        remainingTime = 0;
-        controlPump(false);
-        publishStatus();
     }
-	else {
-        Serial.println("No conditions met! Checking why:");
-        Serial.print("Signal == 'On'? ");
-        Serial.println(signal == "On");
-        Serial.print("State == IDLE? ");
-        Serial.println(currentState == IDLE);
-        Serial.print("Is irrigation time? ");
-        Serial.println(isIrrigationTime());
+    controlPump(pump.isPumpActive());
+    if (!pump.isPumpActive()) {
+        releaseLease();
     }
+    publishStatus();
 }
 
 void handleStateTransitions() {
-    unsigned long currentTime = millis();
+    bool reached = false;
+    if (pump.getState() == IRRIGATING && closedLoop && soil.isValid()) {
+        reached = fieldCapacity.update(soil.getMoisturePermille());
+    }
     
-    switch (currentState) {
-        case IDLE:
-            break;
-            
-        case IRRIGATING:
-            if (!isIrrigationTime()) {
-                currentState = EMERGENCY_HALT;
-                controlPump(false);
-                publishStatus();
-            } else {
-                unsigned long elapsed = currentTime - irrigationStartTime;
-                if (elapsed >= irrigationDuration) {
-                    currentState = IDLE;
-                    irrigationDuration = 0;
-                    remainingTime = 0;
-                    controlPump(false);
-                    publishStatus();
-                    Serial.println("Irrigation completed!");
-                } else {
-                    remainingTime = irrigationDuration - elapsed;
-                    unsigned long remainingMinutes = remainingTime / (60 * 1000);
-                    unsigned long remainingSeconds = (remainingTime % (60 * 1000)) / 1000;
-                    
-                    Serial.print("Remaining: ");
-                    Serial.print(remainingMinutes);
-                    Serial.print(":");
-                    Serial.println(remainingSeconds);
-                }
-            }
-            break;
-            
-        case EMERGENCY_HALT:
-            break;
-            
-        case FAULT:
-            controlPump(false);
-            break;
+    if (pump.update(millis(), isIrrigationTime(), reached)) {
+        controlPump(pump.isPumpActive());
+        if (!pump.isPumpActive()) {
+            releaseLease();
+        }
+        publishStatus();
+        if (strcmp(pump.getStopReason(), "field_capacity") == 0) {
+            Serial.println("Field capacity reached, irrigation stopped early");
+        } else if (strcmp(pump.getStopReason(), "completed") == 0) {
+            Serial.println("Irrigation completed!");
+        }
+    } else if (pump.getState() == IRRIGATING) {
+        unsigned long remainingTime = pump.getRemainingTime();
+        unsigned long remainingMinutes = remainingTime / (60 * 1000);
+        unsigned long remainingSeconds = (remainingTime % (60 * 1000)) / 1000;
+        
+        Serial.print("Remaining: ");
+        Serial.print(remainingMinutes);
+        Serial.print(":");
+        Serial.println(remainingSeconds);
+    } else if (pump.getState() == FAULT) {
+        controlPump(false);
     }
 }
 
@@ -357,34 +483,64 @@ void controlPump(bool state) {
 }
 
 void publishStatus() {
-    doc.clear();
-    
-    String stateStr;
-    switch (currentState) {
-        case IDLE: stateStr = "IDLE"; break;
-        case IRRIGATING: stateStr = "IRRIGATING"; break;
-        case EMERGENCY_HALT: stateStr = "EMERGENCY_HALT"; break;
-        case FAULT: stateStr = "FAULT"; break;
+    statusDoc.clear();
+    
+    statusDoc["id"] = deviceId;
+    statusDoc["state"] = PumpStateMachine::stateName(pump.getState());
+    statusDoc["pump_active"] = pumpActive;
+    statusDoc["remaining_time_minutes"] = pump.getRemainingTime() / (60 * 1000);
+    statusDoc["irrigation_allowed"] = isIrrigationTime();
+    statusDoc["closed_loop"] = closedLoop;
+    if (soil.isValid()) {
+        statusDoc["soil_moisture"] = soil.getMoisturePermille() / 10.0;
     }
-    
-    doc["id"] = deviceId;
-    doc["state"] = stateStr;
-    doc["pump_active"] = pumpActive;
-    doc["remaining_time_minutes"] = remainingTime / (60 * 1000);
-    doc["irrigation_allowed"] = isIrrigationTime();
+    if (pump.getStopReason()[0] != '\0') {
+        statusDoc["stop_reason"] = pump.getStopReason();
+    }
+    if (leaseEnabled) {
+        statusDoc["lease"] = leasePending ? "waiting" : CapacityLease::statusName(lease.getStatus());
+        statusDoc["lease_wait_ms"] = lastLeaseWait;
+        statusDoc["lease_timeouts"] = leaseTimeouts;
+        statusDoc["supply_in_use"] = lease.unitsInUse(epochMillis());
+        statusDoc["supply_budget"] = lease.getBudget();
+    }
+    if (mqttTls) {
+        statusDoc["tls_resumed"] = tlsClient.wasResumed();
+        statusDoc["tls_handshake_ms"] = tlsClient.getHandshakeMs();
+        statusDoc["tls_handshake_heap"] = tlsClient.getHandshakeHeap();
+        statusDoc["tls_heap"] = tlsClient.getHeapUsage();
+        statusDoc["tls_full_handshakes"] = tlsClient.getFullHandshakes();
+        statusDoc["tls_resumed_handshakes"] = tlsClient.getResumedHandshakes();
+    }
+    statusDoc["free_heap"] = ESP.getFreeHeap();
+    statusDoc["min_free_heap"] = ESP.getMinFreeHeap();
     
     struct tm timeinfo;
     if (getLocalTime(&timeinfo)) {
         char timeStr[20];
         strftime(timeStr, sizeof(timeStr), "%H:%M:%S", &timeinfo);
-        doc["current_time"] = timeStr;
+        statusDoc["current_time"] = timeStr;
     }
     
-    String output;
-    serializeJson(doc, output);
+    // A full buffer means the output was cut off; never publish broken JSON
+    size_t length = serializeJson(statusDoc, statusBuffer, sizeof(statusBuffer));
+    if (statusDoc.overflowed() || length >= sizeof(statusBuffer) - 1) {
+        Serial.println("Status did not fit, publishing minimal status");
+        statusDoc.clear();
+        statusDoc["id"] = deviceId;
+        statusDoc["state"] = PumpStateMachine::stateName(pump.getState());
+        statusDoc["pump_active"] = pumpActive;
+        statusDoc["error"] = "status_overflow";
+        serializeJson(statusDoc, statusBuffer, sizeof(statusBuffer));
+    }
     
-    client.publish(mqttTopicPub.c_str(), output.c_str());
-    Serial.println("Status published: " + output);
+    // PubSubClient drops messages larger than its buffer without an error
+    if (!client.publish(mqttTopicPub, statusBuffer)) {
+        Serial.println("Status publish failed");
+        return;
+    }
+    Serial.print("Status published: ");
+    Serial.println(statusBuffer);
 }
 
 bool isIrrigationTime() {
@@ -395,4 +551,128 @@ bool isIrrigationTime() {
     
     int hour = timeinfo.tm_hour;
     return ((hour >= 7 && hour < 9) || (hour >= 16 && hour < 19));
+}
+
+void writeTraceEvent(const TraceEvent& event, void* context) {
+    char line[64];
+    size_t length = formatTraceEvent(event, line, sizeof(line));
+    if (length == 0) return;
+    
+    if (!traceFile) return;
+    
+    // Keep one previous segment so the trace never grows past 2 * TRACE_MAX_BYTES.
+    // The file stays open between events; only rotation reopens it.
+    if (traceFile.size() + length > TRACE_MAX_BYTES) {
+        traceFile.close();
+        SPIFFS.remove(TRACE_OLD_FILE);
+        SPIFFS.rename(TRACE_FILE, TRACE_OLD_FILE);
+        traceFile = SPIFFS.open(TRACE_FILE, FILE_APPEND);
+        if (!traceFile) return;
+    }
+    
+    traceFile.write((const uint8_t*)line, length);
+    traceFile.flush();
+}
+
+void handleLease() {
+    char payload[64];
+    size_t length;
+    uint64_t now = epochMillis();
+    
+    if (leasePending && lease.getStatus() == CapacityLease::LEASE_NONE) {
+        length = lease.request(now, payload, sizeof(payload));
+        publishLease(payload, length);
+    }
+    
+    switch (lease.poll(now, payload, sizeof(payload), &length)) {
+        case CapacityLease::DECISION_GRANTED: {
+            publishLease(payload, length);
+            leasePending = false;
+            lastLeaseEcho = millis();
+            lastLeaseWait = millis() - leaseRequestedAt;
+            Serial.print("Supply lease granted after ");
+            Serial.print(lastLeaseWait);
+            Serial.println(" ms");
+            
+            PumpState previousState = pump.getState();
+            if (pump.handleCommand(SIGNAL_ON, pendingIrrTime, millis(), isIrrigationTime()) == CMD_ACCEPTED) {
+                Serial.println(previousState == EMERGENCY_HALT ? "Resuming from emergency halt" : "Starting irrigation");
+                fieldCapacity.reset();
+                controlPump(pump.isPumpActive());
+            } else {
+                Serial.println("Irrigation no longer allowed, releasing lease");
+                releaseLease();
+            }
+            publishStatus();
+            break;
+        }
+        
+        case CapacityLease::DECISION_TIMED_OUT:
+            publishLease("", 0);
+            leasePending = false;
+            leaseTimeouts++;
+            Serial.println("Supply lease not granted in time, command dropped");
+            publishStatus();
+            break;
+            
+        default:
+            break;
+    }
+    
+    length = lease.renew(now, payload, sizeof(payload));
+    if (length > 0) {
+        publishLease(payload, length);
+    }
+}
+
+void publishLease(const char* payload, size_t length) {
+    client.publish(leaseSelfTopic, (const uint8_t*)payload, length, true);
+}
+
+void releaseLease() {
+    leasePending = false;
+    if (!leaseEnabled) return;
+    
+    if (lease.getStatus() != CapacityLease::LEASE_NONE) {
+        lease.release();
+        publishLease("", 0);
+    }
+}
+
+uint16_t keepAliveSec() {
+    return mqttTls ? MQTT_KEEPALIVE_SEC : MQTT_PLAIN_KEEPALIVE_SEC;
+}
+
+// Renewals go out every half keep-alive, so a full keep-alive without one
+// coming back means the broker may already be counting down our will
+bool brokerLost() {
+    return portal.isPortalActive() || WiFi.status() != WL_CONNECTED || !client.connected() ||
+           millis() - lastLeaseEcho > keepAliveSec() * 1000UL;
+}
+
+void pauseForLease() {
+    Serial.println("Broker unreachable while holding lease - pausing irrigation");
+    pump.handleCommand(SIGNAL_EMERGENCY_HALT, 0, millis(), isIrrigationTime());
+    controlPump(pump.isPumpActive());
+    
+    // Give the capacity back now rather than waiting for the will
+    lease.release();
+    if (client.connected()) {
+        publishLease("", 0);
+    }
+    leasePending = true;
+    leaseRequestedAt = millis();
+}
+
+uint64_t epochMillis() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void copyConfig(char* dest, size_t size, const String& value, const char* name) {
+    if (strlcpy(dest, value.c_str(), size) >= size) {
+        Serial.print(name);
+        Serial.println(" too long, truncated");
+    }
 }
\ No newline at end of file
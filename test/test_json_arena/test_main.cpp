@@ -0,0 +1,353 @@
+// ArduinoJson grows a document in pools of variant slots. On the ESP32 a
+// slot is 8 bytes and a pool holds 128 of them; the host gets the same pool
+// capacity so a document needs as many pools here as on the device.
+#define ESP32_SLOT_SIZE 8
+#define ESP32_POOL_CAPACITY 128
+#define ARDUINOJSON_POOL_CAPACITY ESP32_POOL_CAPACITY
+
+#include <unity.h>
+#include <ArduinoJson.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ArenaAllocator.h"
+#include "CapacityLease.h"
+#include "PumpTrace.h"
+#include "alloc_guard.h"
+#include "json_sizes.h"
+
+// Host slots hold 64-bit pointers, so the host arenas are only sized to run
+// the documents; the device budget is checked in slot units below
+#define HOST_ARENA_SIZE (JSON_ARENA_SIZE * 4)
+#define ARENA_HEADER 8  // ArenaAllocator's per-block header
+
+// Records the first block a document asks for, which is always a whole pool
+class FirstBlock : public ArduinoJson::Allocator {
+public:
+    size_t size;
+    FirstBlock() : size(0) {}
+    void* allocate(size_t n) override {
+        if (size == 0) size = n;
+        return malloc(n);
+    }
+    void deallocate(void* ptr) override { free(ptr); }
+    void* reallocate(void* ptr, size_t n) override { return realloc(ptr, n); }
+};
+
+static size_t hostSlotSize() {
+    FirstBlock first;
+    {
+        JsonDocument doc(&first);
+        doc.add(1);
+    }
+    return first.size / ARDUINOJSON_POOL_CAPACITY;
+}
+
+// Forwards to an arena and tells ArduinoJson's variant pools apart from its
+// strings: a pool is allocated whole and only ever shrunk, to the slots in
+// use, by deserializeJson() / shrinkToFit()
+template <size_t N>
+class PoolTracker : public ArduinoJson::Allocator {
+private:
+    static const int MAX_POOLS = 4;
+    size_t slotSize;
+    void* pools[MAX_POOLS];
+    size_t poolBytes[MAX_POOLS];
+
+    int find(void* ptr) const {
+        for (int i = 0; i < MAX_POOLS; i++) {
+            if (pools[i] == ptr) return i;
+        }
+        return -1;
+    }
+
+public:
+    ArenaAllocator<N> arena;
+    int peakPools;
+
+    explicit PoolTracker(size_t slotSize) : slotSize(slotSize), peakPools(0) {
+        memset(pools, 0, sizeof(pools));
+        memset(poolBytes, 0, sizeof(poolBytes));
+    }
+
+    void* allocate(size_t size) override {
+        void* ptr = arena.allocate(size);
+        int empty = find(NULL);
+        if (ptr != NULL && size == slotSize * ARDUINOJSON_POOL_CAPACITY && empty >= 0) {
+            pools[empty] = ptr;
+            poolBytes[empty] = size;
+            int live = 0;
+            for (int i = 0; i < MAX_POOLS; i++) {
+                live += pools[i] != NULL;
+            }
+            if (live > peakPools) peakPools = live;
+        }
+        return ptr;
+    }
+
+    void deallocate(void* ptr) override {
+        int i = ptr != NULL ? find(ptr) : -1;
+        if (i >= 0) pools[i] = NULL;
+        arena.deallocate(ptr);
+    }
+
+    void* reallocate(void* ptr, size_t size) override {
+        int i = ptr != NULL ? find(ptr) : -1;
+        void* moved = arena.reallocate(ptr, size);
+        if (moved != NULL && i >= 0) {
+            pools[i] = moved;
+            poolBytes[i] = size;
+        }
+        return moved;
+    }
+
+    size_t slotsInUse() const {
+        size_t bytes = 0;
+        for (int i = 0; i < MAX_POOLS; i++) {
+            if (pools[i] != NULL) bytes += poolBytes[i];
+        }
+        return bytes / slotSize;
+    }
+
+    // The arena's high-water mark with the host pool swapped for an ESP32
+    // one; strings are counted at their host size, which is never smaller
+    size_t esp32PeakUsage() const {
+        size_t hostPool = ARENA_HEADER + slotSize * ARDUINOJSON_POOL_CAPACITY;
+        size_t devicePool = ARENA_HEADER + ESP32_SLOT_SIZE * ESP32_POOL_CAPACITY;
+        return arena.peakUsage() - hostPool + devicePool;
+    }
+};
+
+void setUp() {}
+void tearDown() {}
+
+void test_arena_grows_last_block_in_place() {
+    ArenaAllocator<256> arena;
+    void* first = arena.allocate(10);
+    void* last = arena.allocate(10);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_TRUE(arena.reallocate(last, 100) == last);
+    TEST_ASSERT_EQUAL(24 + 8 + 104, arena.peakUsage());
+
+    // Shrinking in place returns the space to the arena
+    TEST_ASSERT_TRUE(arena.reallocate(last, 8) == last);
+    void* next = arena.allocate(8);
+    TEST_ASSERT_TRUE((uint8_t*)next == (uint8_t*)last + 16);
+}
+
+void test_arena_moves_older_block_on_grow() {
+    ArenaAllocator<256> arena;
+    char* first = (char*)arena.allocate(8);
+    memcpy(first, "abcdefg", 8);
+    arena.allocate(8);
+
+    char* moved = (char*)arena.reallocate(first, 32);
+    TEST_ASSERT_NOT_NULL(moved);
+    TEST_ASSERT_TRUE(moved != first);
+    TEST_ASSERT_EQUAL_STRING("abcdefg", moved);
+
+    // Shrinking an older block keeps it where it is
+    TEST_ASSERT_TRUE(arena.reallocate(moved, 8) == moved);
+    TEST_ASSERT_TRUE(arena.reallocate(moved, 32) == moved);
+}
+
+void test_arena_resets_when_all_blocks_freed() {
+    ArenaAllocator<256> arena;
+    void* first = arena.allocate(40);
+    void* second = arena.allocate(40);
+    arena.deallocate(first);
+    void* third = arena.allocate(8);
+    TEST_ASSERT_TRUE(third != first);  // still blocked by `second`
+
+    arena.deallocate(second);
+    arena.deallocate(third);
+    arena.deallocate(NULL);
+    TEST_ASSERT_TRUE(arena.allocate(8) == first);
+}
+
+void test_arena_reports_overflow() {
+    ArenaAllocator<64> arena;
+    TEST_ASSERT_NULL(arena.allocate(64));
+    TEST_ASSERT_EQUAL(1, arena.failureCount());
+
+    void* block = arena.allocate(16);
+    TEST_ASSERT_NOT_NULL(block);
+    TEST_ASSERT_NULL(arena.reallocate(block, 200));
+    TEST_ASSERT_EQUAL(2, arena.failureCount());
+    TEST_ASSERT_LESS_OR_EQUAL(arena.capacity(), arena.peakUsage());
+}
+
+// The firmware's command -> status path: deserialize a command, read it as
+// callback() does, build and serialize a status, over and over, with both
+// documents in arenas
+void test_document_cycles_do_not_allocate() {
+    size_t slotSize = hostSlotSize();
+    static PoolTracker<HOST_ARENA_SIZE> commandArena(slotSize);
+    static PoolTracker<HOST_ARENA_SIZE> statusArena(slotSize);
+    JsonDocument commandDoc(&commandArena);
+    JsonDocument statusDoc(&statusArena);
+    static char statusBuffer[STATUS_BUFFER_SIZE];
+
+    static const char* commands[] = {
+        "{\"id\":\"P-1\",\"signal\":\"On\",\"irr_time\":12.5}",
+        "{\"id\":\"P-2\",\"signal\":\"Emergency Halt\"}",
+        "{\"id\":\"P-1\",\"signal\":\"Stop\",\"note\":\"a fairly long string that has to be copied into the arena\"}",
+        "not json",
+    };
+
+    unsigned long forUs = 0;
+    size_t commandSlots = 0;
+    AllocGuard::arm();
+    for (int cycle = 0; cycle < 1000; cycle++) {
+        const char* command = commands[cycle % 4];
+        DeserializationError error = deserializeJson(commandDoc, command, strlen(command));
+        if (!error) {
+            const char* signal = commandDoc["signal"] | "";
+            float irrTime = commandDoc["irr_time"];
+            const char* targetId = commandDoc["id"] | "";
+            forUs += strcmp(targetId, "P-1") == 0 && signal[0] != '\0' && irrTime >= 0;
+            if (commandArena.slotsInUse() > commandSlots) commandSlots = commandArena.slotsInUse();
+        }
+
+        statusDoc.clear();
+        statusDoc["id"] = "P-1";
+        statusDoc["state"] = cycle % 2 ? "IRRIGATING" : "IDLE";
+        statusDoc["pump_active"] = cycle % 2 == 1;
+        statusDoc["remaining_time_minutes"] = cycle;
+        statusDoc["irrigation_allowed"] = true;
+        statusDoc["closed_loop"] = true;
+        statusDoc["soil_moisture"] = 23.4;
+        statusDoc["stop_reason"] = "field_capacity";
+        statusDoc["lease"] = "held";
+        statusDoc["lease_wait_ms"] = 123456;
+        statusDoc["lease_timeouts"] = 2;
+        statusDoc["supply_in_use"] = 3;
+        statusDoc["supply_budget"] = 4;
+        statusDoc["tls_resumed"] = true;
+        statusDoc["tls_handshake_ms"] = 321;
+        statusDoc["tls_handshake_heap"] = 4567;
+        statusDoc["tls_heap"] = 45678;
+        statusDoc["tls_full_handshakes"] = 1;
+        statusDoc["tls_resumed_handshakes"] = 42;
+        statusDoc["free_heap"] = 123456;
+        statusDoc["min_free_heap"] = 100000;
+        statusDoc["current_time"] = "12:34:56";
+
+        TEST_ASSERT_FALSE(statusDoc.overflowed());
+        size_t length = serializeJson(statusDoc, statusBuffer, sizeof(statusBuffer));
+        TEST_ASSERT_LESS_OR_EQUAL(sizeof(statusBuffer) - 2, length);
+    }
+    unsigned long allocations = AllocGuard::disarm();
+
+    TEST_ASSERT_EQUAL(0, allocations);
+    TEST_ASSERT_EQUAL(500, forUs);
+    TEST_ASSERT_EQUAL(0, commandArena.arena.failureCount());
+    TEST_ASSERT_EQUAL(0, statusArena.arena.failureCount());
+
+    // Both documents must fit one ESP32 pool and the device-sized arena.
+    // irr_time and soil_moisture are doubles, which take two slots there.
+    TEST_ASSERT_EQUAL(1, commandArena.peakPools);
+    TEST_ASSERT_LESS_OR_EQUAL(ESP32_POOL_CAPACITY, commandSlots + 1);
+    TEST_ASSERT_LESS_OR_EQUAL(JSON_ARENA_SIZE, commandArena.esp32PeakUsage());
+
+    statusDoc.shrinkToFit();
+    TEST_ASSERT_EQUAL(1, statusArena.peakPools);
+    TEST_ASSERT_LESS_OR_EQUAL(ESP32_POOL_CAPACITY, statusArena.slotsInUse() + 1);
+    TEST_ASSERT_LESS_OR_EQUAL(JSON_ARENA_SIZE, statusArena.esp32PeakUsage());
+}
+
+// Supply leasing runs from loop(): request, settle, grant, renew, release
+void test_lease_cycles_do_not_allocate() {
+    static CapacityLease lease;
+    TEST_ASSERT_TRUE(lease.begin("P-1", 2, 1, 60000, 100, 9000));
+
+    char payload[64];
+    size_t length;
+    uint64_t now = 1700000000000ULL;
+    unsigned long granted = 0;
+    AllocGuard::arm();
+    for (int cycle = 0; cycle < 200; cycle++) {
+        lease.onMessage("P-2", "H 1 1699999999000 1700099999000", 31, now);
+        length = lease.request(now, payload, sizeof(payload));
+        lease.onMessage("P-1", payload, length, now + 10);
+        lease.poll(now + 50, payload, sizeof(payload), &length);
+        if (lease.poll(now + 200, payload, sizeof(payload), &length) == CapacityLease::DECISION_GRANTED) {
+            lease.onMessage("P-1", payload, length, now + 210);
+            granted++;
+        }
+        length = lease.renew(now + 5000, payload, sizeof(payload));
+        TEST_ASSERT_GREATER_THAN(0, length);
+        lease.release();
+        lease.onMessage("P-1", "", 0, now + 5010);
+        now += 10000;
+    }
+    unsigned long allocations = AllocGuard::disarm();
+
+    TEST_ASSERT_EQUAL(0, allocations);
+    TEST_ASSERT_EQUAL(200, granted);
+}
+
+// Every trace line is formatted into a stack buffer on the device
+void test_trace_format_does_not_allocate() {
+    static const char types[] = {'B', 'C', 'W', 'F', 'K', 'T'};
+    TraceEvent event;
+    memset(&event, 0, sizeof(event));
+    event.timeMs = 123456789;
+    event.signal = 1;
+    event.irrTime = 12.5f;
+    event.flag = true;
+    event.maxMinutes = 480;
+    event.from = 1;
+    event.to = 2;
+    event.remainingMs = 720000;
+    event.gapMs = 9000;
+    strcpy(event.reason, "field_capacity");
+
+    char line[64];
+    size_t total = 0;
+    AllocGuard::arm();
+    for (int cycle = 0; cycle < 600; cycle++) {
+        event.type = types[cycle % 6];
+        total += formatTraceEvent(event, line, sizeof(line)) > 0;
+    }
+    unsigned long allocations = AllocGuard::disarm();
+
+    TEST_ASSERT_EQUAL(0, allocations);
+    TEST_ASSERT_EQUAL(600, total);
+}
+
+void test_document_overflow_is_reported() {
+    static ArenaAllocator<128> arena;
+    JsonDocument doc(&arena);
+
+    const char* command = "{\"P-1\":{\"signal\":\"On\",\"irr_time\":10,\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5}}";
+    AllocGuard::arm();
+    DeserializationError error = deserializeJson(doc, command);
+    TEST_ASSERT_TRUE(error == DeserializationError::NoMemory);
+
+    doc.clear();
+    for (int i = 0; i < 20; i++) {
+        doc["key"][i] = "value";
+    }
+    TEST_ASSERT_TRUE(doc.overflowed());
+    TEST_ASSERT_EQUAL(0, AllocGuard::disarm());
+    TEST_ASSERT_GREATER_THAN(0, arena.failureCount());
+
+    // Once the document lets go, the arena starts over from the front
+    doc.clear();
+    void* block = arena.allocate(120);
+    TEST_ASSERT_NOT_NULL(block);
+    arena.deallocate(block);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_arena_grows_last_block_in_place);
+    RUN_TEST(test_arena_moves_older_block_on_grow);
+    RUN_TEST(test_arena_resets_when_all_blocks_freed);
+    RUN_TEST(test_arena_reports_overflow);
+    RUN_TEST(test_document_cycles_do_not_allocate);
+    RUN_TEST(test_document_overflow_is_reported);
+    RUN_TEST(test_lease_cycles_do_not_allocate);
+    RUN_TEST(test_trace_format_does_not_allocate);
+    return UNITY_END();
+}
@@ -0,0 +1,118 @@
+#include <unity.h>
+#include "MoistureFilter.h"
+
+void setUp() {}
+void tearDown() {}
+
+// Pushes `count` copies of `raw`; returns how many decimated values came out
+static int pushMany(MoistureFilter& filter, uint16_t raw, int count) {
+    int outputs = 0;
+    for (int i = 0; i < count; i++) {
+        outputs += filter.push(raw);
+    }
+    return outputs;
+}
+
+void test_decimation_averages_each_block() {
+    MoistureFilter filter(4);
+    TEST_ASSERT_FALSE(filter.push(1000));
+    TEST_ASSERT_FALSE(filter.push(1100));
+    TEST_ASSERT_FALSE(filter.push(1200));
+    TEST_ASSERT_TRUE(filter.push(1300));
+    TEST_ASSERT_EQUAL_UINT16(1150, filter.rawMedian());
+
+    // Only the low 12 bits of each sample count
+    MoistureFilter masked(1);
+    masked.push(0xF123);
+    TEST_ASSERT_EQUAL_UINT16(0x123, masked.rawMedian());
+}
+
+void test_ready_only_after_full_window() {
+    MoistureFilter filter(2);
+    for (uint8_t i = 0; i < MoistureFilter::MEDIAN_WINDOW; i++) {
+        TEST_ASSERT_FALSE(filter.ready());
+        TEST_ASSERT_EQUAL(1, pushMany(filter, 2000, 2));
+    }
+    TEST_ASSERT_TRUE(filter.ready());
+
+    filter.reset();
+    TEST_ASSERT_FALSE(filter.ready());
+}
+
+void test_median_rejects_single_spike() {
+    MoistureFilter filter(1);
+    pushMany(filter, 2000, 4);
+    filter.push(4095);
+    TEST_ASSERT_TRUE(filter.ready());
+    TEST_ASSERT_EQUAL_UINT16(2000, filter.rawMedian());
+
+    filter.push(0);
+    TEST_ASSERT_EQUAL_UINT16(2000, filter.rawMedian());
+}
+
+void test_moisture_with_capacitive_calibration() {
+    // Capacitive probe: lower reading when wet
+    MoistureFilter filter(1);
+    filter.setCalibration(3000, 1000);
+    pushMany(filter, 2000, MoistureFilter::MEDIAN_WINDOW);
+    TEST_ASSERT_EQUAL_UINT16(500, filter.moisturePermille());
+
+    pushMany(filter, 3500, MoistureFilter::MEDIAN_WINDOW);
+    TEST_ASSERT_EQUAL_UINT16(0, filter.moisturePermille());
+
+    pushMany(filter, 500, MoistureFilter::MEDIAN_WINDOW);
+    TEST_ASSERT_EQUAL_UINT16(1000, filter.moisturePermille());
+}
+
+void test_moisture_with_inverted_calibration() {
+    // Resistive probe: higher reading when wet
+    MoistureFilter filter(1);
+    filter.setCalibration(1000, 3000);
+    pushMany(filter, 1500, MoistureFilter::MEDIAN_WINDOW);
+    TEST_ASSERT_EQUAL_UINT16(250, filter.moisturePermille());
+
+    pushMany(filter, 4000, MoistureFilter::MEDIAN_WINDOW);
+    TEST_ASSERT_EQUAL_UINT16(1000, filter.moisturePermille());
+}
+
+void test_moisture_with_equal_calibration() {
+    MoistureFilter filter(1);
+    filter.setCalibration(2000, 2000);
+    pushMany(filter, 2000, MoistureFilter::MEDIAN_WINDOW);
+    TEST_ASSERT_EQUAL_UINT16(0, filter.moisturePermille());
+}
+
+void test_field_capacity_needs_consecutive_readings() {
+    FieldCapacityDetector detector(350, 3);
+    TEST_ASSERT_FALSE(detector.update(400));
+    TEST_ASSERT_FALSE(detector.update(400));
+    TEST_ASSERT_FALSE(detector.update(349));
+    TEST_ASSERT_FALSE(detector.update(350));
+    TEST_ASSERT_FALSE(detector.update(350));
+    TEST_ASSERT_TRUE(detector.update(350));
+    TEST_ASSERT_TRUE(detector.update(900));
+
+    TEST_ASSERT_FALSE(detector.update(100));
+    detector.update(500);
+    detector.update(500);
+    detector.reset();
+    TEST_ASSERT_FALSE(detector.update(500));
+}
+
+void test_field_capacity_zero_hold_count() {
+    FieldCapacityDetector detector(350, 0);
+    TEST_ASSERT_TRUE(detector.update(350));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_decimation_averages_each_block);
+    RUN_TEST(test_ready_only_after_full_window);
+    RUN_TEST(test_median_rejects_single_spike);
+    RUN_TEST(test_moisture_with_capacitive_calibration);
+    RUN_TEST(test_moisture_with_inverted_calibration);
+    RUN_TEST(test_moisture_with_equal_calibration);
+    RUN_TEST(test_field_capacity_needs_consecutive_readings);
+    RUN_TEST(test_field_capacity_zero_hold_count);
+    return UNITY_END();
+}
@@ -0,0 +1,82 @@
+// Heap-allocation tracking for the host tools and native tests. Replaces the
+// global operator new/delete and, on glibc, malloc/calloc/realloc, so include
+// it in exactly one translation unit.
+//
+// Wrap code that must not allocate (the firmware's post-setup paths) in
+// AllocGuard::arm() / AllocGuard::disarm(); disarm() returns the number of
+// allocations made in between.
+
+#ifndef ALLOC_GUARD_H
+#define ALLOC_GUARD_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace AllocGuard {
+    static bool armed = false;
+    static unsigned long count = 0;
+
+    inline void arm() {
+        count = 0;
+        armed = true;
+    }
+
+    inline unsigned long disarm() {
+        armed = false;
+        return count;
+    }
+
+    inline void record() {
+        if (armed) {
+            count++;
+        }
+    }
+}
+
+#if defined(__GLIBC__)
+// C allocations (ArduinoJson's default allocator, strdup, ...) are counted
+// here; operator new goes through malloc, so it is counted once
+#define ALLOC_GUARD_WRAPS_MALLOC 1
+
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* ptr, std::size_t size);
+
+void* malloc(std::size_t size) noexcept {
+    AllocGuard::record();
+    return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) noexcept {
+    AllocGuard::record();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, std::size_t size) noexcept {
+    AllocGuard::record();
+    return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+static void* trackedAlloc(std::size_t size) {
+#if !defined(ALLOC_GUARD_WRAPS_MALLOC)
+    AllocGuard::record();
+#endif
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(std::size_t size) { return trackedAlloc(size); }
+void* operator new[](std::size_t size) { return trackedAlloc(size); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+#endif
@@ -0,0 +1,232 @@
+// Runs several simulated pump controllers against a real MQTT broker using
+// the firmware's CapacityLease, and reports lease acquisition latency,
+// supply utilisation and any budget violation.
+//
+// Build:  g++ -O2 -std=c++11 -Ilib/CapacityLease/src -o lease_sim tools/lease_sim.cpp
+//             lib/CapacityLease/src/CapacityLease.cpp -lmosquitto
+// Usage:  ./lease_sim [host] [port] [devices] [budget] [seconds] [crashPercent]
+//         (defaults: localhost 1883 8 3 120 5)
+//
+// Each device alternates idle gaps (0-6 s) and irrigation runs (2-8 s) that
+// only start once a lease is granted. With crashPercent > 0, a running device
+// occasionally drops its connection without DISCONNECT so the broker fires
+// its last-will; like the firmware it stops its pump, then reconnects.
+// Exits non-zero if the ground-truth concurrent draw ever exceeds the budget.
+
+#include "CapacityLease.h"
+#include <mosquitto.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LEASE_PREFIX "sim/pump/lease"
+#define MAX_WAIT_MS 30000
+#define SETTLE_MS 500
+#define HOLD_TTL_MS 15000
+
+static uint64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t randomMs(uint32_t lo, uint32_t hi) {
+    return lo + rand() % (hi - lo + 1);
+}
+
+enum SimState { SIM_IDLE, SIM_WAITING, SIM_RUNNING, SIM_CRASHED };
+
+struct Device {
+    std::string id;
+    std::string topic;
+    struct mosquitto* mosq;
+    CapacityLease lease;
+    SimState state;
+    uint64_t nextAt;
+    uint64_t requestedAt;
+};
+
+static const char* host;
+static int port;
+static int budget;
+
+static void onMessage(struct mosquitto*, void* obj, const struct mosquitto_message* msg) {
+    Device* device = static_cast<Device*>(obj);
+    const char* id = strrchr(msg->topic, '/');
+    if (!id) return;
+    device->lease.onMessage(id + 1, (const char*)msg->payload, msg->payloadlen, nowMs());
+}
+
+static void publish(Device& device, const char* payload, size_t length) {
+    mosquitto_publish(device.mosq, NULL, device.topic.c_str(), length, payload, 1, true);
+}
+
+static bool connectDevice(Device& device) {
+    device.mosq = mosquitto_new(device.id.c_str(), true, &device);
+    mosquitto_message_callback_set(device.mosq, onMessage);
+    mosquitto_will_set(device.mosq, device.topic.c_str(), 0, "", 1, true);
+    if (mosquitto_connect(device.mosq, host, port, 10) != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "%s: cannot connect to %s:%d\n", device.id.c_str(), host, port);
+        return false;
+    }
+    if (!device.lease.begin(device.id.c_str(), budget, 1, MAX_WAIT_MS, SETTLE_MS, HOLD_TTL_MS)) {
+        fprintf(stderr, "%s: device ID too long for leasing\n", device.id.c_str());
+        return false;
+    }
+    mosquitto_subscribe(device.mosq, NULL, LEASE_PREFIX "/+", 1);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    host = argc > 1 ? argv[1] : "localhost";
+    port = argc > 2 ? atoi(argv[2]) : 1883;
+    int count = argc > 3 ? atoi(argv[3]) : 8;
+    budget = argc > 4 ? atoi(argv[4]) : 3;
+    int seconds = argc > 5 ? atoi(argv[5]) : 120;
+    int crashPercent = argc > 6 ? atoi(argv[6]) : 5;
+
+    mosquitto_lib_init();
+    srand((unsigned)nowMs());
+
+    std::vector<Device> devices(count);
+    for (int i = 0; i < count; i++) {
+        Device& device = devices[i];
+        device.id = "SIM-" + std::to_string(i + 1);
+        device.topic = std::string(LEASE_PREFIX "/") + device.id;
+        device.state = SIM_IDLE;
+        device.nextAt = nowMs() + randomMs(0, 3000);
+        if (!connectDevice(device)) return 1;
+        // Clear anything a previous run left behind
+        publish(device, "", 0);
+    }
+
+    std::vector<uint64_t> latencies;
+    unsigned long requests = 0, timeouts = 0, crashes = 0;
+    int maxInUse = 0;
+    bool violated = false;
+    uint64_t busyUnitMs = 0;
+
+    uint64_t start = nowMs();
+    uint64_t last = start;
+    uint64_t end = start + seconds * 1000ULL;
+    char payload[64];
+    size_t length;
+
+    while (nowMs() < end) {
+        uint64_t now = nowMs();
+
+        int inUse = 0;
+        for (Device& device : devices) {
+            if (device.state == SIM_RUNNING) inUse++;
+        }
+        busyUnitMs += inUse * (now - last);
+        last = now;
+        maxInUse = std::max(maxInUse, inUse);
+        if (inUse > budget && !violated) {
+            violated = true;
+            fprintf(stderr, "VIOLATION: %d units in use, budget %d\n", inUse, budget);
+        }
+
+        for (Device& device : devices) {
+            if (device.state == SIM_CRASHED) {
+                if (now >= device.nextAt && connectDevice(device)) {
+                    device.state = SIM_IDLE;
+                    device.nextAt = now;
+                }
+                continue;
+            }
+            mosquitto_loop(device.mosq, 0, 1);
+
+            switch (device.state) {
+                case SIM_IDLE:
+                    if (now >= device.nextAt) {
+                        length = device.lease.request(now, payload, sizeof(payload));
+                        publish(device, payload, length);
+                        device.requestedAt = now;
+                        device.state = SIM_WAITING;
+                        requests++;
+                    }
+                    break;
+
+                case SIM_WAITING:
+                    switch (device.lease.poll(now, payload, sizeof(payload), &length)) {
+                        case CapacityLease::DECISION_GRANTED:
+                            publish(device, payload, length);
+                            latencies.push_back(now - device.requestedAt);
+                            device.state = SIM_RUNNING;
+                            device.nextAt = now + randomMs(2000, 8000);
+                            break;
+                        case CapacityLease::DECISION_TIMED_OUT:
+                            publish(device, "", 0);
+                            timeouts++;
+                            device.state = SIM_IDLE;
+                            device.nextAt = now + randomMs(0, 6000);
+                            break;
+                        default:
+                            break;
+                    }
+                    break;
+
+                case SIM_RUNNING:
+                    if (crashPercent > 0 && rand() % 100000 < crashPercent) {
+                        // Roughly crashPercent % of runs: drop without DISCONNECT
+                        mosquitto_destroy(device.mosq);
+                        device.mosq = NULL;
+                        device.state = SIM_CRASHED;
+                        device.nextAt = now + randomMs(1000, 3000);
+                        crashes++;
+                        break;
+                    }
+                    if (now >= device.nextAt) {
+                        device.lease.release();
+                        publish(device, "", 0);
+                        device.state = SIM_IDLE;
+                        device.nextAt = now + randomMs(0, 6000);
+                    } else {
+                        length = device.lease.renew(now, payload, sizeof(payload));
+                        if (length > 0) publish(device, payload, length);
+                    }
+                    break;
+
+                case SIM_CRASHED:
+                    break;
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    for (Device& device : devices) {
+        if (device.mosq) {
+            publish(device, "", 0);
+            mosquitto_loop(device.mosq, 100, 1);
+            mosquitto_disconnect(device.mosq);
+            mosquitto_destroy(device.mosq);
+        }
+    }
+    mosquitto_lib_cleanup();
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t total = 0;
+    for (uint64_t l : latencies) total += l;
+    double elapsed = (double)(last - start);
+
+    printf("%d devices, budget %d, %d s\n", count, budget, seconds);
+    printf("Requests: %lu  granted: %zu  timed out: %lu  crashes: %lu\n",
+           requests, latencies.size(), timeouts, crashes);
+    if (!latencies.empty()) {
+        printf("Lease latency ms: min %llu  avg %llu  p95 %llu  max %llu\n",
+               (unsigned long long)latencies.front(),
+               (unsigned long long)(total / latencies.size()),
+               (unsigned long long)latencies[latencies.size() * 95 / 100],
+               (unsigned long long)latencies.back());
+    }
+    printf("Utilisation: %.1f %% of budget  max concurrent: %d / %d\n",
+           elapsed > 0 ? 100.0 * busyUnitMs / (elapsed * budget) : 0.0, maxInUse, budget);
+    printf("Budget %s\n", violated ? "EXCEEDED" : "respected");
+    return violated ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+// Host-side replay of recorded soil-moisture traces through the firmware's
+// MoistureFilter / FieldCapacityDetector.
+//
+// Build:  g++ -O2 -std=c++11 -Ilib/SoilMoisture/src tools/moisture_trace.cpp -o moisture_trace
+// Usage:  ./moisture_trace trace.txt [decimation] [dryRaw] [wetRaw] [fieldCapacity%]
+//
+// The trace is one raw 12-bit ADC sample per line (lines starting with '#'
+// are skipped). Prints one CSV row per filtered reading, then the sample
+// throughput of the filter. Fails if the filter allocates from the heap.
+
+#include "MoistureFilter.h"
+#include "alloc_guard.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.txt [decimation] [dryRaw] [wetRaw] [fieldCapacity%%]\n", argv[0]);
+        return 2;
+    }
+
+    uint16_t decimation = argc > 2 ? atoi(argv[2]) : 2000;
+    uint16_t dryRaw = argc > 3 ? atoi(argv[3]) : 3000;
+    uint16_t wetRaw = argc > 4 ? atoi(argv[4]) : 1300;
+    uint16_t threshold = argc > 5 ? atoi(argv[5]) * 10 : 350;
+
+    FILE* file = fopen(argv[1], "r");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<uint16_t> samples;
+    char line[64];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        samples.push_back((uint16_t)atoi(line));
+    }
+    fclose(file);
+
+    MoistureFilter filter(decimation);
+    filter.setCalibration(dryRaw, wetRaw);
+    FieldCapacityDetector detector(threshold);
+
+    printf("sample,raw_median,moisture_permille,field_capacity\n");
+    long stopAt = -1;
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (filter.push(samples[i]) && filter.ready()) {
+            bool reached = detector.update(filter.moisturePermille());
+            printf("%zu,%u,%u,%d\n", i, filter.rawMedian(), filter.moisturePermille(), reached);
+            if (reached && stopAt < 0) stopAt = (long)i;
+        }
+    }
+    if (stopAt >= 0) {
+        fprintf(stderr, "Field capacity reached at sample %ld\n", stopAt);
+    } else {
+        fprintf(stderr, "Field capacity not reached\n");
+    }
+
+    // Benchmark: push the whole trace repeatedly, at least 10M samples
+    if (samples.empty()) return 0;
+    size_t rounds = 10000000 / samples.size() + 1;
+    uint32_t sink = 0;
+    filter.reset();
+    auto start = std::chrono::steady_clock::now();
+    AllocGuard::arm();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < samples.size(); i++) {
+            sink += filter.push(samples[i]);
+        }
+    }
+    unsigned long allocations = AllocGuard::disarm();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    fprintf(stderr, "Filter: %.2f ns/sample (%zu samples, %u outputs)\n",
+            ns / (rounds * samples.size()), rounds * samples.size(), sink);
+    if (allocations > 0) {
+        fprintf(stderr, "FAIL: %lu heap allocations in the filter\n", allocations);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Replays a captured command trace through the firmware's PumpStateMachine
+// under a virtual clock and diffs the resulting transitions against the
+// recorded ones. Exits non-zero on any divergence, so it can run in CI.
+//
+// Build:  g++ -O2 -std=c++11 -Ilib/PumpControl/src -o trace_replay tools/trace_replay.cpp
+//             lib/PumpControl/src/PumpStateMachine.cpp lib/PumpControl/src/PumpTrace.cpp
+// Usage:  ./trace_replay trace.log [toleranceMs] [-v]
+//
+// The device ticks the state machine roughly once a second from loop(); the
+// replay ticks exactly every TICK_MS of virtual time, so transition times and
+// remaining times are compared within `toleranceMs` (default 2000). Where the
+// device stalled (K lines), the replay skips the gap and ticks at the
+// recorded time instead.
+//
+// The state machine runs after setup() on the device, where nothing may be
+// heap-allocated; the replay fails if it allocates.
+
+#include "PumpStateMachine.h"
+#include "alloc_guard.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define TICK_MS 1000
+
+static unsigned long droppedTransitions = 0;
+
+// Stores into capacity reserved up front so the replay itself never allocates
+static void collectTransition(const TraceEvent& event, void* context) {
+    std::vector<TraceEvent>* replayed = static_cast<std::vector<TraceEvent>*>(context);
+    if (event.type != 'T') return;
+    if (replayed->size() == replayed->capacity()) {
+        droppedTransitions++;
+        return;
+    }
+    replayed->push_back(event);
+}
+
+static unsigned long absDiff(uint32_t a, uint32_t b) {
+    return a > b ? a - b : b - a;
+}
+
+static void printTransition(const char* prefix, const TraceEvent& t) {
+    printf("%s %10lu ms  %-14s -> %-14s remaining %8lu ms  %s\n", prefix,
+           (unsigned long)t.timeMs,
+           PumpStateMachine::stateName((PumpState)t.from),
+           PumpStateMachine::stateName((PumpState)t.to),
+           (unsigned long)t.remainingMs, t.reason[0] ? t.reason : "-");
+}
+
+// Replays one boot segment (events[begin, end)) and appends the transitions
+// it produces. Returns the virtual time covered in ms.
+static uint64_t replaySegment(const std::vector<TraceEvent>& events, size_t begin, size_t end,
+                              std::vector<TraceEvent>& replayed) {
+    const TraceEvent& boot = events[begin];
+    PumpStateMachine pump(boot.minMinutes, boot.maxMinutes);
+    pump.setTraceCallback(collectTransition, &replayed);
+
+    bool window = false;
+    bool fieldCapacity = false;
+    uint32_t now = boot.timeMs;
+    uint32_t nextTick = boot.timeMs + TICK_MS;
+
+    for (size_t i = begin + 1; i < end; i++) {
+        const TraceEvent& event = events[i];
+        if (event.type == 'T') continue;
+
+        if (event.type == 'K') {
+            // No ticks happened between the last one and this one
+            uint32_t lastTick = event.timeMs - event.gapMs;
+            while ((int32_t)(lastTick - nextTick) >= 0) {
+                pump.update(nextTick, window, fieldCapacity);
+                nextTick += TICK_MS;
+            }
+            nextTick = event.timeMs;
+            continue;
+        }
+
+        while ((int32_t)(event.timeMs - nextTick) > 0) {
+            pump.update(nextTick, window, fieldCapacity);
+            nextTick += TICK_MS;
+        }
+        now = event.timeMs;
+
+        if (event.type == 'W' || event.type == 'F') {
+            if (event.type == 'W') window = event.flag;
+            else fieldCapacity = event.flag;
+
+            // Input changes are recorded wherever the machine first saw them.
+            // If a command follows at the same instant it belongs to that
+            // command, otherwise the device was ticking at this time.
+            bool belongsToCommand = false;
+            for (size_t j = i + 1; j < end && events[j].timeMs == now; j++) {
+                if (events[j].type == 'C') {
+                    belongsToCommand = true;
+                    break;
+                }
+            }
+            if (!belongsToCommand) {
+                pump.update(now, window, fieldCapacity);
+                nextTick = now + TICK_MS;
+            }
+        } else if (event.type == 'C') {
+            pump.handleCommand((PumpSignal)event.signal, event.irrTime, now, window);
+        }
+    }
+
+    // Let a cycle still running at the end of the trace play out. The last
+    // event may be a timer-driven transition the device saw up to one tick
+    // after the replay's tick grid, so run one tick past it.
+    uint32_t last = end > begin + 1 ? events[end - 1].timeMs : now;
+    while ((int32_t)(last + TICK_MS - nextTick) >= 0) {
+        pump.update(nextTick, window, fieldCapacity);
+        nextTick += TICK_MS;
+    }
+    return (uint64_t)(last - boot.timeMs);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.log [toleranceMs] [-v]\n", argv[0]);
+        return 2;
+    }
+
+    unsigned long tolerance = 2000;
+    bool verbose = false;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) verbose = true;
+        else tolerance = strtoul(argv[i], NULL, 10);
+    }
+
+    FILE* file = fopen(argv[1], "r");
+    if (!file) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<TraceEvent> events;
+    std::vector<TraceEvent> recorded;
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        TraceEvent event;
+        if (!parseTraceEvent(line, event)) continue;
+        // Anything before the first boot marker cannot be replayed
+        if (events.empty() && event.type != 'B') continue;
+        events.push_back(event);
+        if (event.type == 'T') recorded.push_back(event);
+    }
+    fclose(file);
+
+    if (events.empty()) {
+        fprintf(stderr, "No boot marker found in trace\n");
+        return 1;
+    }
+
+    std::vector<TraceEvent> replayed;
+    replayed.reserve(recorded.size() * 2 + 64);
+    uint64_t virtualMs = 0;
+    auto start = std::chrono::steady_clock::now();
+    AllocGuard::arm();
+    size_t begin = 0;
+    for (size_t i = 1; i <= events.size(); i++) {
+        if (i == events.size() || events[i].type == 'B') {
+            virtualMs += replaySegment(events, begin, i, replayed);
+            begin = i;
+        }
+    }
+    unsigned long allocations = AllocGuard::disarm();
+    auto end = std::chrono::steady_clock::now();
+    double wallMs = std::chrono::duration<double, std::milli>(end - start).count();
+
+    int mismatches = droppedTransitions > 0 ? 1 : 0;
+    if (droppedTransitions > 0) {
+        printf("%lu extra replayed transitions not shown\n", droppedTransitions);
+    }
+    size_t count = recorded.size() > replayed.size() ? recorded.size() : replayed.size();
+    for (size_t i = 0; i < count; i++) {
+        bool haveRecorded = i < recorded.size();
+        bool haveReplayed = i < replayed.size();
+        bool match = haveRecorded && haveReplayed &&
+                     recorded[i].from == replayed[i].from &&
+                     recorded[i].to == replayed[i].to &&
+                     strcmp(recorded[i].reason, replayed[i].reason) == 0 &&
+                     absDiff(recorded[i].timeMs, replayed[i].timeMs) <= tolerance &&
+                     absDiff(recorded[i].remainingMs, replayed[i].remainingMs) <= tolerance;
+
+        if (!match) {
+            mismatches++;
+            printf("Transition %zu differs:\n", i);
+            if (haveRecorded) printTransition("  recorded", recorded[i]);
+            if (haveReplayed) printTransition("  replayed", replayed[i]);
+        } else if (verbose) {
+            printTransition("  ok      ", replayed[i]);
+        }
+    }
+
+    printf("%zu events, %zu recorded / %zu replayed transitions, %d mismatches\n",
+           events.size(), recorded.size(), replayed.size(), mismatches);
+    printf("Replayed %.1f h of device time in %.1f ms (%.0fx real time)\n",
+           virtualMs / 3600000.0, wallMs, wallMs > 0 ? virtualMs / wallMs : 0.0);
+    if (allocations > 0) {
+        printf("FAIL: %lu heap allocations during replay\n", allocations);
+        return 1;
+    }
+    return mismatches ? 1 : 0;
+}